@@ -7,7 +7,7 @@ cleanup() {
 
 trap cleanup EXIT
 
-screen -S qemu -d -m qemu-system-i386 -S -s -hda rootfs.img
+screen -S qemu -d -m qemu-system-i386 -smp ${SMP:-2} -S -s -hda rootfs.img
 
 TERM=xterm gdb-multiarch -x gdb_os.txt
 
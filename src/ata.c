@@ -0,0 +1,417 @@
+#include "ata.h"
+#include "ide.h"
+#include "interrupt.h"
+#include "io.h"
+#include "kmalloc.h"
+#include "page.h"
+#include "pci.h"
+#include "rprintf.h"
+#include "thread.h"
+#include "trace.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define ATA_DATA        0x1F0
+#define ATA_SECCOUNT    0x1F2
+#define ATA_LBA0        0x1F3
+#define ATA_LBA1        0x1F4
+#define ATA_LBA2        0x1F5
+#define ATA_DRIVE       0x1F6
+#define ATA_STATUS      0x1F7
+#define ATA_COMMAND     0x1F7
+#define ATA_CONTROL     0x3F6
+
+#define ATA_SR_BSY      0x80
+#define ATA_SR_DF       0x20
+#define ATA_SR_DRQ      0x08
+#define ATA_SR_ERR      0x01
+
+#define ATA_CMD_READ     0x20
+#define ATA_CMD_WRITE    0x30
+#define ATA_CMD_FLUSH    0xE7
+#define ATA_CMD_READ_DMA  0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+
+//Bus master IDE registers, relative to BAR4, primary channel
+#define BM_COMMAND      0x00
+#define BM_STATUS       0x02
+#define BM_PRDT         0x04
+
+#define BM_CMD_START    0x01
+#define BM_CMD_READ     0x08            // device to memory
+#define BM_SR_ERR       0x02
+#define BM_SR_IRQ       0x04
+
+//Physical region descriptor. A region may not cross a 64 KiB boundary;
+//a byte count of 0 means 64 KiB.
+struct prd {
+    uint32_t phys_addr;
+    uint16_t byte_count;
+    uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT         0x8000
+#define PRDT_ENTRIES    (PAGE_SIZE_BYTES / sizeof(struct prd))
+
+struct ata_stats g_ata_stats;
+
+//requests waiting for the drive; the head is the one in flight
+static struct ata_request *queue_head = NULL;
+static struct ata_request *queue_tail = NULL;
+static int ata_irq_ready = 0;
+
+//threads sleeping in ata_wait, woken whenever a request finishes
+static struct wait_queue ata_waiters;
+
+//bus master state, valid when ata_dma_ready is set
+static int ata_dma_ready = 0;
+static uint16_t bm_base = 0;
+static struct prd *prdt = NULL;
+
+//Bus address of a buffer byte (physical, no IOMMU)
+static inline uint32_t dma_phys(const void *p) {
+    return virt_to_phys(p);
+}
+
+//Fill the PRD table for a buffer. Each page is translated on its own and
+//physically contiguous pages share an entry as long as it stays inside
+//one 64 KiB region. Fails if part of the buffer isn't mapped.
+static int ata_build_prdt(uint8_t *buf, uint32_t bytes) {
+    uint32_t va = (uint32_t)buf;
+    uint32_t len = 0;                   // bytes in prdt[i - 1]
+    uint32_t i = 0;
+
+    while (bytes > 0) {
+        uint32_t addr = dma_phys((void *)va);
+        if (addr == VIRT_TO_PHYS_NONE)
+            return -1;
+        uint32_t chunk = PAGE_SIZE_BYTES - (va & (PAGE_SIZE_BYTES - 1));
+        if (chunk > bytes)
+            chunk = bytes;
+
+        if (i && prdt[i - 1].phys_addr + len == addr &&
+            (prdt[i - 1].phys_addr & 0xFFFF) + len + chunk <= 0x10000) {
+            len += chunk;
+        } else {
+            if (i >= PRDT_ENTRIES)
+                return -1;
+            prdt[i].phys_addr = addr;
+            prdt[i].flags = 0;
+            len = chunk;
+            i++;
+        }
+        prdt[i - 1].byte_count = len & 0xFFFF;      // 0 means 64 KiB
+        va += chunk;
+        bytes -= chunk;
+    }
+    prdt[i - 1].flags = PRD_EOT;
+    return 0;
+}
+
+//Find the PCI IDE controller and set up its bus master engine. Leaves
+//ata_dma_ready clear (PIO only) if anything is missing.
+static void ata_dma_init(void) {
+    struct pci_device dev;
+    if (pci_find_class(0x01, 0x01, &dev) != 0 || !(dev.prog_if & 0x80)) {
+        esp_sink_printf(vga_sink, NULL, "ATA: no bus master IDE controller, using PIO\n");
+        return;
+    }
+
+    uint32_t bar4 = pci_config_read32(dev.bus, dev.slot, dev.func, PCI_BAR4);
+    if (!(bar4 & 1)) {
+        esp_sink_printf(vga_sink, NULL, "ATA: bus master BAR is not I/O space, using PIO\n");
+        return;
+    }
+    bm_base = bar4 & 0xFFFC;
+
+    //the status register shares the dword and its error bits clear when
+    //written as 1, so only the command word goes back
+    uint32_t cmd = pci_config_read32(dev.bus, dev.slot, dev.func, PCI_COMMAND);
+    pci_config_write32(dev.bus, dev.slot, dev.func, PCI_COMMAND,
+                       (cmd & 0xFFFF) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    //one page holds the PRD table; being page aligned it can't cross 64 KiB
+    struct ppage *pg = allocate_physical_pages(1);
+    if (!pg || !map_pages(pg->physical_addr, pg, pd)) {
+        if (pg)
+            free_physical_pages(pg);
+        esp_sink_printf(vga_sink, NULL, "ATA: no frame for PRD table, using PIO\n");
+        return;
+    }
+    prdt = (struct prd *)pg->physical_addr;
+
+    esp_sink_printf(vga_sink, NULL, "ATA: bus master DMA at I/O %x (PCI %x:%x)\n",
+                    bm_base, dev.vendor_id, dev.device_id);
+    ata_dma_ready = 1;
+}
+
+static void ata_start(struct ata_request *req) {
+    while (inb(ATA_STATUS) & ATA_SR_BSY)
+        ;
+
+    //no data and no sector registers; the IRQ comes when the cache is out
+    if (req->flush) {
+        outb(ATA_CONTROL, 0);
+        outb(ATA_DRIVE, 0xE0);
+        outb(ATA_COMMAND, ATA_CMD_FLUSH);
+        return;
+    }
+
+    //a buffer the PRD table can't describe goes by PIO instead
+    if (req->dma && ata_build_prdt(req->buffer, req->nsectors * 512) != 0)
+        req->dma = 0;
+    if (req->dma) {
+        outb(bm_base + BM_COMMAND, 0);
+        outl(bm_base + BM_PRDT, dma_phys(prdt));
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);   // write 1 to clear
+        outb(bm_base + BM_COMMAND, req->write ? 0 : BM_CMD_READ);
+    }
+
+    outb(ATA_CONTROL, 0);               // nIEN clear: drive raises IRQ14
+    outb(ATA_DRIVE, 0xE0 | ((req->lba >> 24) & 0x0F));
+    outb(ATA_SECCOUNT, (uint8_t)req->nsectors);
+    outb(ATA_LBA0, req->lba & 0xFF);
+    outb(ATA_LBA1, (req->lba >> 8) & 0xFF);
+    outb(ATA_LBA2, (req->lba >> 16) & 0xFF);
+
+    if (req->dma) {
+        outb(ATA_COMMAND, req->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+        outb(bm_base + BM_COMMAND, (req->write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    } else if (req->write) {
+        //PIO write: the first sector is sent once DRQ is up, the rest from
+        //the IRQ that acknowledges the previous one
+        outb(ATA_COMMAND, ATA_CMD_WRITE);
+        uint8_t status;
+        while ((status = inb(ATA_STATUS)) & ATA_SR_BSY)
+            ;
+        if ((status & ATA_SR_DRQ) && !(status & (ATA_SR_ERR | ATA_SR_DF)))
+            outsw(ATA_DATA, req->buffer, 256);
+    } else {
+        outb(ATA_COMMAND, ATA_CMD_READ);
+    }
+}
+
+//retire the head request and start the next one
+static void ata_finish(struct ata_request *req, int status) {
+    queue_head = req->next;
+    if (!queue_head)
+        queue_tail = NULL;
+    req->next = NULL;
+
+    req->status = status;
+    if (req->complete)
+        req->complete(req);
+    thread_wake_all(&ata_waiters);
+
+    if (queue_head)
+        ata_start(queue_head);
+}
+
+//DMA: one IRQ for the whole request. PIO: one IRQ per sector, when the
+//drive has a DRQ block ready (or failed).
+static void ata_irq_handler(struct interrupt_frame *frame) {
+    uint64_t start = rdtsc();
+    g_ata_stats.irqs++;
+
+    struct ata_request *req = queue_head;
+
+    if (req && req->dma) {
+        uint8_t bm_status = inb(bm_base + BM_STATUS);
+        if (!(bm_status & BM_SR_IRQ)) {
+            //not ours; still read the status register to deassert IRQ14
+            inb(ATA_STATUS);
+            return;
+        }
+
+        outb(bm_base + BM_COMMAND, 0);
+        uint8_t status = inb(ATA_STATUS);
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+
+        if ((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+            ata_finish(req, ATA_REQ_ERROR);
+        } else {
+            req->done_sectors = req->nsectors;
+            g_ata_stats.sectors += req->nsectors;
+            ata_finish(req, ATA_REQ_DONE);
+        }
+        g_ata_stats.irq_cycles += rdtsc() - start;
+        return;
+    }
+
+    //reading the status register acknowledges the interrupt
+    uint8_t status = inb(ATA_STATUS);
+
+    if (req) {
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+            ata_finish(req, ATA_REQ_ERROR);
+        } else if (req->flush) {
+            ata_finish(req, ATA_REQ_DONE);
+        } else if (req->write) {
+            //one IRQ per sector written; DRQ is set again if more are wanted
+            req->done_sectors++;
+            g_ata_stats.sectors++;
+            if (req->done_sectors == req->nsectors)
+                ata_finish(req, ATA_REQ_DONE);
+            else if (status & ATA_SR_DRQ)
+                outsw(ATA_DATA, req->buffer + req->done_sectors * 512, 256);
+        } else if (status & ATA_SR_DRQ) {
+            insw(ATA_DATA, req->buffer + req->done_sectors * 512, 256);
+            req->done_sectors++;
+            g_ata_stats.sectors++;
+            if (req->done_sectors == req->nsectors)
+                ata_finish(req, ATA_REQ_DONE);
+        }
+    }
+
+    g_ata_stats.irq_cycles += rdtsc() - start;
+}
+
+void ata_init(void) {
+    ata_dma_init();
+    register_interrupt_handler(IRQ_VECTOR(IRQ_ATA0), ata_irq_handler);
+    pic_unmask_irq(IRQ_ATA0);
+    ata_irq_ready = 1;
+}
+
+//Queue a request. It is started at once if the drive is idle. Fails until
+//ata_init() has hooked up IRQ14.
+int ata_submit(struct ata_request *req) {
+    if (!ata_irq_ready || !req)
+        return -1;
+    if (!req->flush && (req->nsectors == 0 || req->nsectors > ATA_MAX_SECTORS))
+        return -1;
+
+    //DMA needs an even buffer address
+    req->dma = !req->flush && ata_dma_ready && !((uint32_t)req->buffer & 1);
+
+    req->done_sectors = 0;
+    req->status = ATA_REQ_PENDING;
+    req->next = NULL;
+
+    uint32_t flags = irq_save();
+    g_ata_stats.requests++;
+    if (req->dma)
+        g_ata_stats.dma_requests++;
+    if (queue_tail) {
+        queue_tail->next = req;
+        queue_tail = req;
+    } else {
+        queue_head = queue_tail = req;
+        ata_start(req);
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+//Halt until the request completes. sti;hlt is atomic, so an IRQ that
+//lands between the check and the hlt still wakes us.
+int ata_wait(struct ata_request *req) {
+    uint32_t flags = irq_save();
+    while (req->status == ATA_REQ_PENDING)
+        thread_wait(&ata_waiters);
+    irq_restore(flags);
+    return req->status == ATA_REQ_DONE ? 0 : -1;
+}
+
+//Split a transfer into requests of at most ATA_MAX_SECTORS and wait for
+//each in turn
+static int ata_transfer(uint32_t lba, uint8_t *buf, uint32_t nsectors, int write) {
+    while (nsectors > 0) {
+        uint32_t n = nsectors > ATA_MAX_SECTORS ? ATA_MAX_SECTORS : nsectors;
+
+        if (ata_irq_ready) {
+            struct ata_request req;
+            TRACE_BEGIN(write ? "ata_write" : "ata_read");
+            req.lba = lba;
+            req.buffer = buf;
+            req.nsectors = n;
+            req.write = write;
+            req.flush = 0;
+            req.complete = NULL;
+            req.priv = NULL;
+            int err = ata_submit(&req) != 0 || ata_wait(&req) != 0;
+            TRACE_END();
+            if (err)
+                return -1;
+        } else {
+            TRACE_BEGIN(write ? "ata_lba_write" : "ata_lba_read");
+            int err = (write ? ata_lba_write(lba, buf, n) : ata_lba_read(lba, buf, n)) != 0;
+            TRACE_END();
+            if (err)
+                return -1;
+        }
+
+        lba += n;
+        buf += n * 512;
+        nsectors -= n;
+    }
+    return 0;
+}
+
+int ata_read(uint32_t lba, void *buffer, uint32_t nsectors) {
+    return ata_transfer(lba, (uint8_t *)buffer, nsectors, 0);
+}
+
+int ata_write(uint32_t lba, const void *buffer, uint32_t nsectors) {
+    return ata_transfer(lba, (uint8_t *)buffer, nsectors, 1);
+}
+
+//Queued behind any writes still in flight, so it covers them too
+int ata_flush(void) {
+    if (!ata_irq_ready)
+        return 0;
+
+    struct ata_request req;
+    TRACE_BEGIN("ata_flush");
+    req.lba = 0;
+    req.buffer = NULL;
+    req.nsectors = 0;
+    req.write = 0;
+    req.flush = 1;
+    req.complete = NULL;
+    req.priv = NULL;
+    int err = ata_submit(&req) != 0 || ata_wait(&req) != 0;
+    TRACE_END();
+    return err ? -1 : 0;
+}
+
+//Compare the polling ide.s path with the IRQ-driven PIO and DMA paths on
+//the same sectors. "busy" is the time the CPU actually spent in the IRQ
+//handler; the rest of an IRQ path's cycles were spent halted.
+void ata_benchmark(uint32_t lba, uint32_t nsectors) {
+    uint8_t *buf = kmalloc(nsectors * 512);
+    if (!buf)
+        return;
+
+    //warm up the drive's own cache so every path sees the same state
+    ata_read(lba, buf, nsectors);
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t done = 0; done < nsectors; ) {
+        uint32_t n = nsectors - done > 128 ? 128 : nsectors - done;
+        ata_lba_read(lba + done, buf + done * 512, n);
+        done += n;
+    }
+    uint32_t poll_cycles = (uint32_t)(rdtsc() - t0);
+
+    int dma_ready = ata_dma_ready;
+    uint32_t irq_cycles[2] = { 0, 0 };
+    uint32_t busy_cycles[2] = { 0, 0 };
+    for (int dma = 0; dma <= dma_ready; dma++) {
+        ata_dma_ready = dma;
+        uint64_t busy0 = g_ata_stats.irq_cycles;
+        t0 = rdtsc();
+        ata_read(lba, buf, nsectors);
+        irq_cycles[dma] = (uint32_t)(rdtsc() - t0);
+        busy_cycles[dma] = (uint32_t)(g_ata_stats.irq_cycles - busy0);
+    }
+    ata_dma_ready = dma_ready;
+
+    esp_sink_printf(vga_sink, NULL, "ATA %d sectors, cycles/sector: polling %d, irq pio %d (busy %d)",
+                    nsectors, poll_cycles / nsectors, irq_cycles[0] / nsectors, busy_cycles[0] / nsectors);
+    if (dma_ready)
+        esp_sink_printf(vga_sink, NULL, ", dma %d (busy %d)", irq_cycles[1] / nsectors, busy_cycles[1] / nsectors);
+    esp_sink_printf(vga_sink, NULL, "\n");
+    kfree(buf);
+}
@@ -0,0 +1,67 @@
+#ifndef __ATA_H__
+#define __ATA_H__
+
+#include <stdint.h>
+
+/*
+ * Interrupt-driven ATA driver for the primary channel master drive.
+ * Requests are queued and completed from IRQ14; the submitter is notified
+ * through the request's status and an optional completion callback.
+ *
+ * When a bus-master IDE controller is found on PCI, whole requests are
+ * transferred by DMA with a single command and a single interrupt.
+ * Otherwise transfers fall back to PIO, one DRQ block (sector) per IRQ.
+ *
+ * Writes may sit in the drive's write cache. A flush request (FLUSH CACHE)
+ * completes once everything written before it is on the media.
+ *
+ */
+
+#define ATA_REQ_PENDING 0
+#define ATA_REQ_DONE    1
+#define ATA_REQ_ERROR   2
+
+//ATA sector count register is 8 bits (0 means 256)
+#define ATA_MAX_SECTORS 256
+
+struct ata_request {
+    uint32_t lba;
+    uint8_t *buffer;
+    uint32_t nsectors;
+    uint8_t write;                      // 1 to write buffer to disk
+    uint8_t flush;                      // 1 for a cache flush, no data
+    uint8_t dma;                        // set by ata_submit when DMA is used
+    uint32_t done_sectors;
+    volatile int status;
+    void (*complete)(struct ata_request *req);
+    void *priv;                         // for the completion callback
+    struct ata_request *next;
+};
+
+struct ata_stats {
+    uint32_t requests;
+    uint32_t dma_requests;
+    uint32_t sectors;
+    uint32_t irqs;
+    uint64_t irq_cycles;                // cycles spent inside the IRQ handler
+};
+
+void ata_init(void);
+int ata_submit(struct ata_request *req);
+int ata_wait(struct ata_request *req);
+
+//Synchronous read through the interrupt path once ata_init() has run,
+//through the polling ata_lba_read() before that
+int ata_read(uint32_t lba, void *buffer, uint32_t nsectors);
+
+//Synchronous write, DMA when available and PIO otherwise
+int ata_write(uint32_t lba, const void *buffer, uint32_t nsectors);
+
+//Wait until the drive's write cache is on the media. Before ata_init()
+//this is a no-op: the polling ata_lba_write() flushes after every write.
+int ata_flush(void);
+
+extern struct ata_stats g_ata_stats;
+void ata_benchmark(uint32_t lba, uint32_t nsectors);
+
+#endif
@@ -0,0 +1,373 @@
+#include "bcache.h"
+#include "ata.h"
+#include "klib.h"
+#include "kmalloc.h"
+#include "rprintf.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+//Largest run of missing sectors fetched with one ata_read call
+#define BCACHE_MAX_RUN 128
+
+static struct buf *g_bufs = NULL;
+static uint8_t *g_buf_data = NULL;
+static struct buf *g_hash[BCACHE_HASH_SIZE];
+
+//LRU list: head is the most recently used buffer, tail the least
+static struct buf *g_lru_head = NULL;
+static struct buf *g_lru_tail = NULL;
+
+//Read-ahead requests. A busy slot's data is not in the cache yet.
+struct ra_slot {
+    struct ata_request req;
+    uint8_t *data;
+    uint8_t busy;
+};
+static struct ra_slot g_ra[BCACHE_RA_SLOTS];
+
+struct bcache_stats g_bcache_stats;
+
+static inline void copy_sector(void *dest, const void *src) {
+    memcpy(dest, src, BCACHE_SECTOR_SIZE);
+}
+
+static inline uint32_t hash_lba(uint32_t lba) {
+    return (lba ^ (lba >> 8)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static struct buf *hash_lookup(uint32_t lba) {
+    for (struct buf *b = g_hash[hash_lba(lba)]; b; b = b->hash_next)
+        if (b->valid && b->lba == lba)
+            return b;
+    return NULL;
+}
+
+static void hash_remove(struct buf *b) {
+    struct buf **pp = &g_hash[hash_lba(b->lba)];
+    while (*pp && *pp != b)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static void hash_insert(struct buf *b) {
+    uint32_t h = hash_lba(b->lba);
+    b->hash_next = g_hash[h];
+    g_hash[h] = b;
+}
+
+static void lru_remove(struct buf *b) {
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        g_lru_head = b->lru_next;
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        g_lru_tail = b->lru_prev;
+    b->lru_next = b->lru_prev = NULL;
+}
+
+static void lru_push_front(struct buf *b) {
+    b->lru_prev = NULL;
+    b->lru_next = g_lru_head;
+    if (g_lru_head)
+        g_lru_head->lru_prev = b;
+    g_lru_head = b;
+    if (!g_lru_tail)
+        g_lru_tail = b;
+}
+
+static void touch(struct buf *b) {
+    if (g_lru_head != b) {
+        lru_remove(b);
+        lru_push_front(b);
+    }
+}
+
+//Take the least recently used unpinned buffer and rebind it to lba. The
+//returned buffer is not valid yet and sits at the front of the LRU list.
+static struct buf *get_victim(uint32_t lba) {
+    struct buf *b = g_lru_tail;
+    while (b && b->refcnt)
+        b = b->lru_prev;
+    if (!b)
+        return NULL;
+
+    if (b->valid) {
+        hash_remove(b);
+        g_bcache_stats.evictions++;
+        if (b->prefetched)
+            g_bcache_stats.ra_wasted++;
+    }
+    b->valid = 0;
+    b->prefetched = 0;
+    b->lba = lba;
+    touch(b);
+    return b;
+}
+
+static void note_hit(struct buf *b) {
+    g_bcache_stats.hits++;
+    if (b->prefetched) {
+        g_bcache_stats.ra_hits++;
+        b->prefetched = 0;
+    }
+}
+
+//Read-ahead slot whose request covers lba, if any
+static struct ra_slot *ra_find(uint32_t lba) {
+    for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+        struct ra_slot *s = &g_ra[i];
+        if (s->busy && lba >= s->req.lba && lba < s->req.lba + s->req.nsectors)
+            return s;
+    }
+    return NULL;
+}
+
+//Wait for a read-ahead request and move its sectors into the cache
+static void ra_install(struct ra_slot *s) {
+    s->busy = 0;
+    if (ata_wait(&s->req) != 0) {
+        g_bcache_stats.ra_wasted += s->req.nsectors;
+        return;
+    }
+    for (uint32_t i = 0; i < s->req.nsectors; i++) {
+        if (hash_lookup(s->req.lba + i))
+            continue;
+        struct buf *b = get_victim(s->req.lba + i);
+        if (!b) {
+            g_bcache_stats.ra_wasted += s->req.nsectors - i;
+            return;
+        }
+        copy_sector(b->data, s->data + i * BCACHE_SECTOR_SIZE);
+        b->valid = 1;
+        b->prefetched = 1;
+        hash_insert(b);
+    }
+}
+
+//Wait for and throw away read-ahead that overlaps [lba, lba + nsectors)
+static void ra_drop(uint32_t lba, uint32_t nsectors) {
+    for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+        struct ra_slot *s = &g_ra[i];
+        if (s->busy && s->req.lba < lba + nsectors && lba < s->req.lba + s->req.nsectors) {
+            ata_wait(&s->req);
+            s->busy = 0;
+            g_bcache_stats.ra_wasted += s->req.nsectors;
+        }
+    }
+}
+
+//Start reading sectors the caller expects to need soon. Sectors already
+//cached or on their way are trimmed from both ends; nothing happens if
+//the driver can't queue requests or all slots are still in flight.
+void bcache_prefetch(uint32_t lba, uint32_t nsectors) {
+    if (!g_bufs)
+        return;
+    if (nsectors > BCACHE_MAX_RUN)
+        nsectors = BCACHE_MAX_RUN;
+    while (nsectors && (hash_lookup(lba) || ra_find(lba))) {
+        lba++;
+        nsectors--;
+    }
+    while (nsectors && (hash_lookup(lba + nsectors - 1) || ra_find(lba + nsectors - 1)))
+        nsectors--;
+    if (!nsectors)
+        return;
+
+    struct ra_slot *s = NULL;
+    for (int i = 0; i < BCACHE_RA_SLOTS && !s; i++)
+        if (!g_ra[i].busy)
+            s = &g_ra[i];
+    for (int i = 0; i < BCACHE_RA_SLOTS && !s; i++) {
+        if (g_ra[i].req.status != ATA_REQ_PENDING) {
+            ra_install(&g_ra[i]);
+            s = &g_ra[i];
+        }
+    }
+    if (!s || !s->data)
+        return;
+
+    s->req.lba = lba;
+    s->req.buffer = s->data;
+    s->req.nsectors = nsectors;
+    s->req.write = 0;
+    s->req.flush = 0;
+    s->req.complete = NULL;
+    s->req.priv = NULL;
+    if (ata_submit(&s->req) != 0)
+        return;
+    s->busy = 1;
+    g_bcache_stats.ra_requests++;
+    g_bcache_stats.ra_sectors += nsectors;
+}
+
+int bcache_init(void) {
+    if (g_bufs)
+        return 0;
+
+    g_bufs = kzalloc(CONFIG_BCACHE_SECTORS * sizeof(struct buf));
+    g_buf_data = kmalloc(CONFIG_BCACHE_SECTORS * BCACHE_SECTOR_SIZE);
+    if (!g_bufs || !g_buf_data) {
+        kfree(g_bufs);
+        kfree(g_buf_data);
+        g_bufs = NULL;
+        g_buf_data = NULL;
+        esp_sink_printf(vga_sink, NULL, "Out of memory for buffer cache\n");
+        return -1;
+    }
+
+    for (int i = 0; i < BCACHE_HASH_SIZE; i++)
+        g_hash[i] = NULL;
+    g_lru_head = g_lru_tail = NULL;
+    for (int i = 0; i < CONFIG_BCACHE_SECTORS; i++) {
+        g_bufs[i].data = g_buf_data + i * BCACHE_SECTOR_SIZE;
+        lru_push_front(&g_bufs[i]);
+    }
+
+    //read-ahead is optional, go without it if the heap is tight
+    for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+        g_ra[i].busy = 0;
+        g_ra[i].data = kmalloc(BCACHE_MAX_RUN * BCACHE_SECTOR_SIZE);
+    }
+    return 0;
+}
+
+//Return a pinned buffer holding sector lba, reading it on a miss
+struct buf *bread(uint32_t lba) {
+    struct buf *b = hash_lookup(lba);
+    if (!b) {
+        struct ra_slot *s = ra_find(lba);
+        if (s) {
+            ra_install(s);
+            b = hash_lookup(lba);
+        }
+    }
+    if (b) {
+        note_hit(b);
+        b->refcnt++;
+        touch(b);
+        return b;
+    }
+
+    g_bcache_stats.misses++;
+    b = get_victim(lba);
+    if (!b)
+        return NULL;
+
+    g_bcache_stats.disk_reads++;
+    if (ata_read(lba, b->data, 1) != 0)
+        return NULL;
+
+    b->valid = 1;
+    b->refcnt = 1;
+    hash_insert(b);
+    return b;
+}
+
+void brelse(struct buf *b) {
+    if (b && b->refcnt)
+        b->refcnt--;
+}
+
+//Copy nsectors starting at lba into dst. Cached sectors are copied from
+//memory; each run of missing sectors is read from disk with one request
+//straight into dst and then added to the cache.
+int bcache_read(uint32_t lba, void *dst, uint32_t nsectors) {
+    uint8_t *out = (uint8_t *)dst;
+    uint32_t i = 0;
+
+    while (i < nsectors) {
+        struct buf *b = hash_lookup(lba + i);
+        if (!b) {
+            struct ra_slot *s = ra_find(lba + i);
+            if (s) {
+                ra_install(s);
+                b = hash_lookup(lba + i);
+            }
+        }
+        if (b) {
+            note_hit(b);
+            copy_sector(out + i * BCACHE_SECTOR_SIZE, b->data);
+            touch(b);
+            i++;
+            continue;
+        }
+
+        uint32_t j = i + 1;
+        while (j < nsectors && j - i < BCACHE_MAX_RUN && !hash_lookup(lba + j) && !ra_find(lba + j))
+            j++;
+
+        g_bcache_stats.misses += j - i;
+        g_bcache_stats.disk_reads++;
+        if (ata_read(lba + i, out + i * BCACHE_SECTOR_SIZE, j - i) != 0)
+            return -1;
+
+        for (; i < j; i++) {
+            b = get_victim(lba + i);
+            if (!b)
+                continue;
+            copy_sector(b->data, out + i * BCACHE_SECTOR_SIZE);
+            b->valid = 1;
+            hash_insert(b);
+        }
+    }
+    return 0;
+}
+
+//Write nsectors from src to disk with one request per BCACHE_MAX_RUN and
+//refresh any cached copies. Sectors that are not cached are not added, so
+//streaming writes don't push out the read working set.
+int bcache_write(uint32_t lba, const void *src, uint32_t nsectors) {
+    const uint8_t *in = (const uint8_t *)src;
+
+    ra_drop(lba, nsectors);
+
+    for (uint32_t i = 0; i < nsectors; i += BCACHE_MAX_RUN) {
+        uint32_t n = nsectors - i > BCACHE_MAX_RUN ? BCACHE_MAX_RUN : nsectors - i;
+        g_bcache_stats.disk_writes++;
+        if (ata_write(lba + i, in + i * BCACHE_SECTOR_SIZE, n) != 0)
+            return -1;
+    }
+
+    for (uint32_t i = 0; i < nsectors; i++) {
+        struct buf *b = hash_lookup(lba + i);
+        if (b)
+            copy_sector(b->data, in + i * BCACHE_SECTOR_SIZE);
+    }
+    return 0;
+}
+
+//Write a pinned buffer back after modifying its data
+int bwrite(struct buf *b) {
+    ra_drop(b->lba, 1);
+    g_bcache_stats.disk_writes++;
+    return ata_write(b->lba, b->data, 1);
+}
+
+//Drop every unpinned buffer, e.g. when the underlying volume changes
+void bcache_invalidate(void) {
+    ra_drop(0, 0xFFFFFFFF);
+    for (int i = 0; i < CONFIG_BCACHE_SECTORS && g_bufs; i++) {
+        struct buf *b = &g_bufs[i];
+        if (b->valid && !b->refcnt) {
+            hash_remove(b);
+            b->valid = 0;
+        }
+    }
+}
+
+void bcache_print_stats(void) {
+    uint32_t lookups = g_bcache_stats.hits + g_bcache_stats.misses;
+    esp_sink_printf(vga_sink, NULL, "Buffer cache: %d hits, %d misses (%d pct hit), %d evictions, %d disk reads, %d disk writes\n",
+                    g_bcache_stats.hits, g_bcache_stats.misses,
+                    lookups ? (g_bcache_stats.hits * 100) / lookups : 0,
+                    g_bcache_stats.evictions, g_bcache_stats.disk_reads,
+                    g_bcache_stats.disk_writes);
+    esp_sink_printf(vga_sink, NULL, "Read-ahead: %d requests, %d sectors, %d used, %d wasted\n",
+                    g_bcache_stats.ra_requests, g_bcache_stats.ra_sectors,
+                    g_bcache_stats.ra_hits, g_bcache_stats.ra_wasted);
+}
@@ -0,0 +1,60 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Sector buffer cache sitting between the filesystem and the ATA driver.
+ * Buffers are found by LBA through a hash table and recycled in LRU order.
+ * A buffer returned by bread() is pinned until brelse() and is never
+ * evicted while pinned. Writes go straight through to the disk.
+ *
+ * bcache_prefetch() starts an asynchronous read into a staging buffer; its
+ * sectors are moved into the cache by the first lookup that needs one.
+ *
+ */
+
+#ifndef CONFIG_BCACHE_SECTORS
+#define CONFIG_BCACHE_SECTORS 512
+#endif
+
+#define BCACHE_SECTOR_SIZE 512
+#define BCACHE_HASH_SIZE   256
+#define BCACHE_RA_SLOTS    4            // read-ahead requests in flight
+
+struct buf {
+    uint32_t lba;
+    uint8_t *data;
+    uint32_t refcnt;            // pin count
+    uint8_t valid;
+    uint8_t prefetched;         // read ahead and not used yet
+    struct buf *hash_next;
+    struct buf *lru_next;       // towards least recently used
+    struct buf *lru_prev;       // towards most recently used
+};
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t disk_reads;        // ata_read requests issued
+    uint32_t disk_writes;       // ata_write requests issued
+    uint32_t ra_requests;       // read-ahead requests issued
+    uint32_t ra_sectors;        // sectors read ahead
+    uint32_t ra_hits;           // read-ahead sectors later used
+    uint32_t ra_wasted;         // read-ahead sectors dropped unused
+};
+
+int bcache_init(void);
+struct buf *bread(uint32_t lba);
+void brelse(struct buf *b);
+int bwrite(struct buf *b);
+int bcache_read(uint32_t lba, void *dst, uint32_t nsectors);
+int bcache_write(uint32_t lba, const void *src, uint32_t nsectors);
+void bcache_prefetch(uint32_t lba, uint32_t nsectors);
+void bcache_invalidate(void);
+
+extern struct bcache_stats g_bcache_stats;
+void bcache_print_stats(void);
+
+#endif
@@ -0,0 +1,99 @@
+#include "clock.h"
+#include "interrupt.h"
+#include "io.h"
+#include <stdint.h>
+
+#define PIT_CH0         0x40
+#define PIT_CH2         0x42
+#define PIT_MODE        0x43
+#define PIT_CH2_ONESHOT 0xB0        // channel 2, lobyte/hibyte, mode 0
+#define PIT_CH0_RATE    0x34        // channel 0, lobyte/hibyte, mode 2
+#define PORT_B          0x61
+#define PORT_B_GATE2    0x01
+#define PORT_B_SPEAKER  0x02
+#define PORT_B_OUT2     0x20
+
+#define CALIBRATE_MS    10
+#define CALIBRATE_LATCH (PIT_HZ / (1000 / CALIBRATE_MS))
+
+//ns = cycles * ns_mult >> NS_SHIFT
+#define NS_SHIFT 24
+
+static uint32_t tsc_khz = 0;
+static uint32_t ns_mult = 0;
+static uint64_t boot_tsc = 0;
+
+uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32;
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+
+    //r < d, so the quotient of r:lo fits in 32 bits
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+void clock_init(void) {
+    //gate channel 2 on with the speaker off and start a one-shot; OUT2
+    //goes high in port B when it reaches zero
+    outb(PORT_B, (inb(PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+    outb(PIT_MODE, PIT_CH2_ONESHOT);
+    outb(PIT_CH2, CALIBRATE_LATCH & 0xFF);
+    outb(PIT_CH2, CALIBRATE_LATCH >> 8);
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t spin = 0; !(inb(PORT_B) & PORT_B_OUT2); spin++)
+        if (spin > 10000000)
+            return;                 // no PIT: leave the clock at 0
+    uint32_t cycles = (uint32_t)(rdtsc() - t0);
+
+    tsc_khz = cycles / CALIBRATE_MS;
+    if (!tsc_khz)
+        return;
+    ns_mult = (uint32_t)div64_32(1000000ull << NS_SHIFT, tsc_khz);
+    boot_tsc = t0;
+}
+
+void pit_start_periodic(uint32_t hz) {
+    uint32_t divisor = PIT_HZ / hz;
+
+    outb(PIT_MODE, PIT_CH0_RATE);
+    outb(PIT_CH0, divisor & 0xFF);
+    outb(PIT_CH0, divisor >> 8);
+}
+
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+//split so the products can't overflow: hi * mult is scaled up by
+//32 - NS_SHIFT bits, lo * mult down by NS_SHIFT
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    uint32_t hi = cycles >> 32;
+    uint32_t lo = (uint32_t)cycles;
+
+    return (((uint64_t)hi * ns_mult) << (32 - NS_SHIFT)) +
+           (((uint64_t)lo * ns_mult) >> NS_SHIFT);
+}
+
+uint32_t clock_cycles_to_us(uint64_t cycles) {
+    return (uint32_t)div64_32(clock_cycles_to_ns(cycles), 1000);
+}
+
+uint64_t clock_now_ns(void) {
+    return tsc_khz ? clock_cycles_to_ns(rdtsc() - boot_tsc) : 0;
+}
+
+uint32_t clock_now_us(void) {
+    return (uint32_t)div64_32(clock_now_ns(), 1000);
+}
+
+void clock_udelay(uint32_t us) {
+    uint64_t cycles = div64_32((uint64_t)us * tsc_khz, 1000);
+    uint64_t start = rdtsc();
+
+    while (rdtsc() - start < cycles)
+        __asm__ __volatile__("pause");
+}
@@ -0,0 +1,35 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+
+/*
+ * TSC clock source. clock_init() counts TSC cycles across a 10 ms one-shot
+ * on PIT channel 2 and derives a fixed point multiplier, so converting
+ * cycles to nanoseconds is two multiplies and a shift. Times read before
+ * clock_init() convert to 0.
+ *
+ */
+
+#define PIT_HZ 1193182
+
+void clock_init(void);
+uint32_t clock_tsc_khz(void);
+
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint32_t clock_cycles_to_us(uint64_t cycles);
+
+//time since clock_init()
+uint64_t clock_now_ns(void);
+uint32_t clock_now_us(void);
+
+//Busy wait on the TSC; returns at once if the clock isn't calibrated
+void clock_udelay(uint32_t us);
+
+//Run PIT channel 0 as a periodic interrupt (IRQ0) at hz
+void pit_start_periodic(uint32_t hz);
+
+//64 by 32 bit division; the kernel is built without libgcc
+uint64_t div64_32(uint64_t n, uint32_t d);
+
+#endif
@@ -1,42 +1,148 @@
 #include "fat.h"
-#include "ide.h"
+#include "ata.h"
+#include "bcache.h"
+#include "klib.h"
+#include "log.h"
+#include "kmalloc.h"
+#include "page.h"
 #include "rprintf.h"
+#include "smp.h"
+#include "thread.h"
 #include <stdint.h>
 #include <stddef.h>
 
-static void *memcpy_local(void *dest, const void *src, size_t n) {
-    uint8_t *d = (uint8_t *)dest;
-    const uint8_t *s = (const uint8_t *)src;
-    while (n--) *d++ = *s++;
-    return dest;
-}
+struct boot_sector g_boot_sector;
+uint32_t g_partition_lba_offset = 2048;
+static uint8_t g_is_initialized = 0;
 
-static void *memset_local(void *s, int c, size_t n) {
-    uint8_t *p = (uint8_t *)s;
-    while (n--) *p++ = (uint8_t)c;
-    return s;
-}
+//Sized from the boot sector at mount time
+static uint8_t *g_fat_table = NULL;
+static uint8_t *g_rde_buffer = NULL;
+static uint8_t *g_cluster_buf = NULL;
+static uint32_t g_cluster_buf_cluster = 0;  //cluster held in g_cluster_buf, 0 if none
+static uint8_t g_cluster_buf_dirty = 0;     //g_cluster_buf holds data not yet on disk
+static uint32_t g_cluster_bytes = 0;
+static uint32_t g_root_dir_sectors = 0;
+static uint32_t g_first_data_lba = 0;
+static uint32_t g_root_dir_lba = 0;
+static uint32_t g_fat_lba = 0;
+static uint32_t g_max_cluster = 0;          //highest valid cluster number
 
-static int memcmp_local(const void *s1, const void *s2, size_t n) {
-    const uint8_t *p1 = (const uint8_t *)s1;
-    const uint8_t *p2 = (const uint8_t *)s2;
-    while (n--) {
-        if (*p1 != *p2) return *p1 - *p2;
-        p1++;
-        p2++;
-    }
-    return 0;
-}
+//One bit per FAT sector modified since the last flush
+static uint8_t *g_fat_dirty = NULL;
+static uint32_t g_fat_dirty_count = 0;
+static uint32_t g_next_free_cluster = 2;    //where the free cluster search resumes
 
+#define FAT16_EOC 0xFFFF
 
-struct boot_sector g_boot_sector;
-static uint8_t g_fat_table[65536];
-uint32_t g_partition_lba_offset = 2048;
-static uint8_t g_is_initialized = 0;
+//fat_dir_scan/fat_lookup/fat_resolve result when a directory read fails,
+//as opposed to -1 for a name that isn't there
+#define FAT_LOOKUP_EIO -2
+
+//Root directory index: the directory stays resident in g_rde_buffer and its
+//entries are chained into hash buckets keyed by the packed 8.3 name
+#define FAT_DIR_HASH_SIZE 256
+#define FAT_DIR_NONE      0xFFFF
+static uint16_t g_dir_hash[FAT_DIR_HASH_SIZE];
+static uint16_t *g_dir_hash_next = NULL;
+
+//Where a directory entry lives on disk, along with a copy of it
+struct fat_dirent {
+    struct root_directory_entry rde;
+    uint32_t lba;
+    uint32_t slot;
+};
+
+//Dentry cache: resolved path components keyed by (parent directory cluster,
+//name). Negative entries remember names that don't exist. Components
+//longer than FAT_DCACHE_NAME_LEN are looked up but not cached.
+#define FAT_DCACHE_SIZE     64
+#define FAT_DCACHE_HASH     32
+#define FAT_DCACHE_NAME_LEN 48
+
+struct fat_dentry {
+    uint32_t parent;                    // cluster of the directory, 0 for root
+    char name[FAT_DCACHE_NAME_LEN];     // lower case
+    uint8_t in_use;
+    uint8_t negative;
+    uint32_t last_used;
+    struct fat_dirent ent;
+    struct fat_dentry *hash_next;
+};
+
+//Memory mapped files. A mapping takes a snapshot of the file's first
+//cluster and size; pages are read straight from disk into their frame on
+//first touch, without going through the buffer cache.
+#define FAT_MAX_MAPPINGS 8
+
+struct fat_mapping {
+    uint32_t vaddr;
+    uint32_t npages;
+    uint32_t start_cluster;
+    uint32_t file_size;
+    uint32_t cur_cluster;               // chain cursor, so sequential faults
+    uint32_t cur_index;                 // don't rewalk the chain
+    uint8_t in_use;
+};
+
+static struct fat_mapping g_mappings[FAT_MAX_MAPPINGS];
+
+static struct fat_dentry g_dcache[FAT_DCACHE_SIZE];
+static struct fat_dentry *g_dcache_hash[FAT_DCACHE_HASH];
+static uint32_t g_dcache_clock = 0;
+
+//Largest transfer handed to a single bcache_read call
+#define FAT_MAX_READ_SECTORS 128
+
+//Read-ahead window limit; the window starts at one cluster and doubles on
+//each sequential read
+#define FAT_RA_MAX_SECTORS 128
+
+
+#define FAT_MAX_OPEN_FILES 8
+static struct file g_file_handles[FAT_MAX_OPEN_FILES];
+static uint8_t g_file_in_use[FAT_MAX_OPEN_FILES];
+
+//fat_lock is held for the whole of every public call. Calls sleep on the
+//disk while holding it, so a waiting thread yields to the holder instead of
+//spinning out its time slice. It nests: a fault on a fatMmap range inside
+//a call (say, fatWrite from a mapped buffer) takes it again.
+static struct spinlock fat_lock = SPINLOCK_INIT;
+static struct thread *volatile fat_owner = NULL;
+static uint32_t fat_depth = 0;
+
+//The disk driver sleeps through the scheduler, which only runs on the
+//bootstrap processor, so calls from other CPUs are refused
+static int fat_enter(void) {
+    if (smp_cpu_index() != 0) {
+        log_err("fat: call from cpu %d refused\n", smp_cpu_index());
+        return -1;
+    }
 
+    struct thread *self = thread_current();
+    if (fat_depth && fat_owner == self) {
+        fat_depth++;
+        return 0;
+    }
 
-static struct file g_file_handles[8];
-static uint8_t g_next_file_handle = 0;
+    uint32_t ticket = spin_take_ticket(&fat_lock);
+    while (fat_lock.owner != ticket) {
+        if (self)
+            thread_yield();
+        else
+            smp_relax();
+    }
+    fat_owner = self;
+    fat_depth = 1;
+    return 0;
+}
+
+static void fat_leave(void) {
+    if (--fat_depth == 0) {
+        fat_owner = NULL;
+        spin_unlock(&fat_lock);
+    }
+}
 
 extern int vga_putc(int c);
 
@@ -66,153 +172,1367 @@ static void filename_to_fat(const char *filename, char *fat_name, char *fat_ext)
     }
 }
 
-int fatInit(void) {
+//FNV-1a over the 11 name bytes
+static uint32_t fat_dir_hash(const char *name, const char *ext) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 8; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    for (int i = 0; i < 3; i++) {
+        h = (h ^ (uint8_t)ext[i]) * 16777619u;
+    }
+    return h & (FAT_DIR_HASH_SIZE - 1);
+}
+
+static void fat_dir_index_insert(uint32_t i) {
+    struct root_directory_entry *rde = (struct root_directory_entry *)g_rde_buffer + i;
+    uint32_t h = fat_dir_hash(rde->file_name, rde->file_extension);
+    g_dir_hash_next[i] = g_dir_hash[h];
+    g_dir_hash[h] = (uint16_t)i;
+}
+
+//Index every live entry; deleted slots, volume labels and LFN pieces are
+//not lookup targets
+static void fat_dir_index_build(void) {
+    struct root_directory_entry *rde_tbl = (struct root_directory_entry *)g_rde_buffer;
+
+    for (int i = 0; i < FAT_DIR_HASH_SIZE; i++) {
+        g_dir_hash[i] = FAT_DIR_NONE;
+    }
+    for (uint32_t i = 0; i < g_boot_sector.num_root_dir_entries; i++) {
+        if (rde_tbl[i].file_name[0] == 0x00) {
+            break;
+        }
+        if ((uint8_t)rde_tbl[i].file_name[0] == 0xE5 || (rde_tbl[i].attribute & FILE_ATTRIBUTE_VOLUME_LABEL)) {
+            continue;
+        }
+        fat_dir_index_insert(i);
+    }
+}
+
+//Return the root directory slot holding the 8.3 name, or -1
+static int fat_dir_index_lookup(const char *name, const char *ext) {
+    struct root_directory_entry *rde_tbl = (struct root_directory_entry *)g_rde_buffer;
+    uint16_t i = g_dir_hash[fat_dir_hash(name, ext)];
+
+    for (; i != FAT_DIR_NONE; i = g_dir_hash_next[i]) {
+        if (memcmp(rde_tbl[i].file_name, name, 8) == 0 &&
+            memcmp(rde_tbl[i].file_extension, ext, 3) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline uint32_t fat_cluster_lba(uint32_t cluster) {
+    return g_first_data_lba + (cluster - 2) * g_boot_sector.num_sectors_per_cluster;
+}
+
+static inline char fat_tolower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static int fat_name_eq(const char *a, const char *b) {
+    while (*a && fat_tolower(*a) == fat_tolower(*b)) {
+        a++;
+        b++;
+    }
+    return fat_tolower(*a) == fat_tolower(*b);
+}
+
+//Does name fit in an 8.3 entry as is? Only those can be in the root index.
+static int fat_is_short_name(const char *name) {
+    int base = 0, ext = -1;
+
+    if (name[0] == '.') {
+        return 0;
+    }
+    for (; *name; name++) {
+        if (*name == '.') {
+            if (ext >= 0) {
+                return 0;
+            }
+            ext = 0;
+        } else if (*name == ' ') {
+            return 0;
+        } else if (ext >= 0) {
+            ext++;
+        } else {
+            base++;
+        }
+    }
+    return base >= 1 && base <= 8 && ext <= 3;
+}
+
+//Format an entry's 8.3 name as "NAME.EXT"
+static void fat_short_name(const struct root_directory_entry *rde, char *out) {
+    int n = 0;
+    for (int i = 0; i < 8 && rde->file_name[i] != ' '; i++) {
+        out[n++] = rde->file_name[i];
+    }
+    if ((uint8_t)out[0] == 0x05) {
+        out[0] = (char)0xE5;            //0x05 escapes a real leading 0xE5
+    }
+    if (rde->file_extension[0] != ' ') {
+        out[n++] = '.';
+        for (int i = 0; i < 3 && rde->file_extension[i] != ' '; i++) {
+            out[n++] = rde->file_extension[i];
+        }
+    }
+    out[n] = 0;
+}
+
+static uint8_t fat_lfn_checksum(const struct root_directory_entry *rde) {
+    const uint8_t *p = (const uint8_t *)rde->file_name;     //name and extension
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + p[i];
+    }
+    return sum;
+}
+
+//Copy one LFN piece into its place in name. UCS-2 outside ASCII becomes '?'.
+static void fat_lfn_collect(const struct lfn_entry *e, char *name) {
+    uint16_t chars[LFN_CHARS];
+    int pos = ((e->order & LFN_ORDER_MASK) - 1) * LFN_CHARS;
+
+    memcpy(chars, e->name1, sizeof(e->name1));
+    memcpy(chars + 5, e->name2, sizeof(e->name2));
+    memcpy(chars + 11, e->name3, sizeof(e->name3));
+    for (int i = 0; i < LFN_CHARS; i++) {
+        if (chars[i] == 0x0000) {
+            name[pos + i] = 0;
+            return;
+        }
+        name[pos + i] = chars[i] < 0x80 ? (char)chars[i] : '?';
+    }
+}
+
+//Look name up in a directory (cluster 0 for the root) by scanning its
+//entries, matching either the long name or the 8.3 name. Returns 0 when
+//found, -1 when not, FAT_LOOKUP_EIO when the directory couldn't be read.
+static int fat_dir_scan(uint32_t dir_cluster, const char *name, struct fat_dirent *out) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t spc = g_boot_sector.num_sectors_per_cluster;
+    uint32_t cluster = dir_cluster;
+    uint32_t sector = 0;
+    char lfn[FAT_LFN_MAX + 1];
+    char short_name[13];
+    int lfn_next = -1;                  //order of the LFN piece expected next
+    uint8_t lfn_sum = 0;
+
+    for (;;) {
+        uint32_t lba;
+        struct buf *b = NULL;
+        const uint8_t *data;
+
+        if (dir_cluster == 0) {
+            if (sector >= g_root_dir_sectors) {
+                return -1;
+            }
+            lba = g_root_dir_lba + sector;
+            data = g_rde_buffer + sector * 512;
+        } else {
+            if (sector == spc) {
+                cluster = fat16[cluster];
+                sector = 0;
+            }
+            if (cluster >= 0xFFF8) {
+                return -1;
+            }
+            if (cluster < 2 || cluster > g_max_cluster) {
+                return FAT_LOOKUP_EIO;
+            }
+            lba = fat_cluster_lba(cluster) + sector;
+            b = bread(lba);
+            if (!b) {
+                return FAT_LOOKUP_EIO;
+            }
+            data = b->data;
+        }
+
+        const struct root_directory_entry *rde_tbl = (const struct root_directory_entry *)data;
+        for (uint32_t i = 0; i < 16; i++) {
+            const struct root_directory_entry *rde = &rde_tbl[i];
+
+            if (rde->file_name[0] == 0x00) {
+                brelse(b);
+                return -1;
+            }
+            if ((uint8_t)rde->file_name[0] == 0xE5) {
+                lfn_next = -1;
+                continue;
+            }
+            if (rde->attribute == FILE_ATTRIBUTE_LFN) {
+                const struct lfn_entry *e = (const struct lfn_entry *)rde;
+                int order = e->order & LFN_ORDER_MASK;
+                if (e->order & LFN_LAST_ENTRY) {
+                    lfn_next = (order >= 1 && order * LFN_CHARS <= FAT_LFN_MAX) ? order : -1;
+                    lfn_sum = e->checksum;
+                    if (lfn_next > 0) {
+                        lfn[order * LFN_CHARS] = 0;
+                    }
+                }
+                if (lfn_next > 0 && order == lfn_next && e->checksum == lfn_sum) {
+                    fat_lfn_collect(e, lfn);
+                    lfn_next--;
+                } else {
+                    lfn_next = -1;
+                }
+                continue;
+            }
+            if (rde->attribute & FILE_ATTRIBUTE_VOLUME_LABEL) {
+                lfn_next = -1;
+                continue;
+            }
+
+            int match = lfn_next == 0 && fat_lfn_checksum(rde) == lfn_sum && fat_name_eq(lfn, name);
+            lfn_next = -1;
+            if (!match) {
+                fat_short_name(rde, short_name);
+                match = fat_name_eq(short_name, name);
+            }
+            if (match) {
+                memcpy(&out->rde, rde, sizeof(struct root_directory_entry));
+                out->lba = lba;
+                out->slot = i;
+                brelse(b);
+                return 0;
+            }
+        }
+        brelse(b);
+        sector++;
+    }
+}
+
+static uint32_t fat_dcache_hash(uint32_t parent, const char *name) {
+    uint32_t h = 2166136261u ^ parent;
+    for (; *name; name++) {
+        h = (h ^ (uint8_t)fat_tolower(*name)) * 16777619u;
+    }
+    return h & (FAT_DCACHE_HASH - 1);
+}
+
+static void fat_dcache_unhash(struct fat_dentry *d) {
+    struct fat_dentry **pp = &g_dcache_hash[fat_dcache_hash(d->parent, d->name)];
+    while (*pp && *pp != d) {
+        pp = &(*pp)->hash_next;
+    }
+    if (*pp) {
+        *pp = d->hash_next;
+    }
+    d->in_use = 0;
+}
+
+static void fat_dcache_reset(void) {
+    for (int i = 0; i < FAT_DCACHE_HASH; i++) {
+        g_dcache_hash[i] = NULL;
+    }
+    for (int i = 0; i < FAT_DCACHE_SIZE; i++) {
+        g_dcache[i].in_use = 0;
+    }
+}
+
+static struct fat_dentry *fat_dcache_find(uint32_t parent, const char *name) {
+    struct fat_dentry *d = g_dcache_hash[fat_dcache_hash(parent, name)];
+    for (; d; d = d->hash_next) {
+        if (d->parent == parent && fat_name_eq(d->name, name)) {
+            d->last_used = ++g_dcache_clock;
+            return d;
+        }
+    }
+    return NULL;
+}
+
+//Remember a lookup result (ent NULL for a miss), recycling the least
+//recently used entry when full
+static void fat_dcache_add(uint32_t parent, const char *name, const struct fat_dirent *ent) {
+    int len = 0;
+    while (name[len]) {
+        len++;
+    }
+    if (len >= FAT_DCACHE_NAME_LEN) {
+        return;
+    }
+
+    struct fat_dentry *d = &g_dcache[0];
+    for (int i = 0; i < FAT_DCACHE_SIZE; i++) {
+        if (!g_dcache[i].in_use) {
+            d = &g_dcache[i];
+            break;
+        }
+        if (g_dcache[i].last_used < d->last_used) {
+            d = &g_dcache[i];
+        }
+    }
+    if (d->in_use) {
+        fat_dcache_unhash(d);
+    }
+
+    d->parent = parent;
+    for (int i = 0; i <= len; i++) {
+        d->name[i] = fat_tolower(name[i]);
+    }
+    d->negative = ent == NULL;
+    if (ent) {
+        memcpy(&d->ent, ent, sizeof(struct fat_dirent));
+    }
+    d->last_used = ++g_dcache_clock;
+    d->in_use = 1;
+
+    uint32_t h = fat_dcache_hash(parent, d->name);
+    d->hash_next = g_dcache_hash[h];
+    g_dcache_hash[h] = d;
+}
+
+//Find one path component in a directory: dentry cache, then the root
+//index, then a directory scan. Both outcomes are cached.
+static int fat_lookup(uint32_t dir_cluster, const char *name, struct fat_dirent *out) {
+    struct fat_dentry *d = fat_dcache_find(dir_cluster, name);
+    if (d) {
+        if (d->negative) {
+            return -1;
+        }
+        memcpy(out, &d->ent, sizeof(struct fat_dirent));
+        return 0;
+    }
+
+    int found = -1;
+    if (dir_cluster == 0 && fat_is_short_name(name)) {
+        char fat_name[8], fat_ext[3];
+        filename_to_fat(name, fat_name, fat_ext);
+        int i = fat_dir_index_lookup(fat_name, fat_ext);
+        if (i >= 0) {
+            memcpy(&out->rde, (struct root_directory_entry *)g_rde_buffer + i,
+                         sizeof(struct root_directory_entry));
+            out->lba = g_root_dir_lba + i / 16;
+            out->slot = i % 16;
+            found = 0;
+        }
+    }
+    if (found != 0) {
+        found = fat_dir_scan(dir_cluster, name, out);
+    }
+
+    //a failed read proves nothing, so only real answers are cached
+    if (found != FAT_LOOKUP_EIO) {
+        fat_dcache_add(dir_cluster, name, found == 0 ? out : NULL);
+    }
+    return found;
+}
+
+//Walk a path from the root directory, one component at a time. Returns
+//0, -1 if the path doesn't name an entry or FAT_LOOKUP_EIO.
+static int fat_resolve(const char *path, struct fat_dirent *out) {
+    char component[FAT_LFN_MAX + 1];
+    uint32_t dir_cluster = 0;
+
+    for (;;) {
+        while (*path == '/') {
+            path++;
+        }
+        if (!*path) {
+            return -1;
+        }
+        int n = 0;
+        while (path[n] && path[n] != '/') {
+            if (n >= FAT_LFN_MAX) {
+                return -1;
+            }
+            component[n] = path[n];
+            n++;
+        }
+        component[n] = 0;
+        path += n;
+        while (*path == '/') {
+            path++;
+        }
+
+        int err = fat_lookup(dir_cluster, component, out);
+        if (err != 0) {
+            return err;
+        }
+        if (!*path) {
+            return 0;
+        }
+        if (!(out->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)) {
+            return -1;
+        }
+        dir_cluster = out->rde.cluster;     //".." back to the root is cluster 0
+    }
+}
+
+static int fat_init(void) {
     uint8_t sector_buf[512];
-    esp_printf(vga_putc, "Initializing FAT filesystem...\n");
+    log_info("Initializing FAT filesystem...\n");
 
 
-    if (ata_lba_read(g_partition_lba_offset, sector_buf, 1) != 0) {
-        esp_printf(vga_putc, "Failed to read boot sector\n");
+    if (ata_read(g_partition_lba_offset, sector_buf, 1) != 0) {
+        log_err("Failed to read boot sector\n");
         return -1;
     }
 
-    memcpy_local(&g_boot_sector, sector_buf, sizeof(struct boot_sector));
+    memcpy(&g_boot_sector, sector_buf, sizeof(struct boot_sector));
 
-    esp_printf(vga_putc, "Bytes per sector: %d\n", g_boot_sector.bytes_per_sector);
-    esp_printf(vga_putc, "Sectors per cluster: %d\n", g_boot_sector.num_sectors_per_cluster);
-    esp_printf(vga_putc, "Reserved sectors: %d\n", g_boot_sector.num_reserved_sectors);
-    esp_printf(vga_putc, "Number of FATs: %d\n", g_boot_sector.num_fat_tables);
-    esp_printf(vga_putc, "Root entries: %d\n", g_boot_sector.num_root_dir_entries);
-    esp_printf(vga_putc, "Sectors per FAT: %d\n", g_boot_sector.num_sectors_per_fat);
-    esp_printf(vga_putc, "Reading FAT table (%d sectors)...\n", g_boot_sector.num_sectors_per_fat);
+    log_debug("Bytes per sector: %d\n", g_boot_sector.bytes_per_sector);
+    log_debug("Sectors per cluster: %d\n", g_boot_sector.num_sectors_per_cluster);
+    log_debug("Reserved sectors: %d\n", g_boot_sector.num_reserved_sectors);
+    log_debug("Number of FATs: %d\n", g_boot_sector.num_fat_tables);
+    log_debug("Root entries: %d\n", g_boot_sector.num_root_dir_entries);
+    log_debug("Sectors per FAT: %d\n", g_boot_sector.num_sectors_per_fat);
+    log_debug("Reading FAT table (%d sectors)...\n", g_boot_sector.num_sectors_per_fat);
     uint32_t fat_lba = g_partition_lba_offset + g_boot_sector.num_reserved_sectors;
 
-    uint32_t sectors_to_read = g_boot_sector.num_sectors_per_fat;
-    if (sectors_to_read > 128) sectors_to_read = 128;
+    kfree(g_fat_table);
+    kfree(g_rde_buffer);
+    kfree(g_cluster_buf);
+    kfree(g_fat_dirty);
+    kfree(g_dir_hash_next);
+    g_dir_hash_next = NULL;
+    g_fat_table = g_rde_buffer = g_cluster_buf = g_fat_dirty = NULL;
+    g_cluster_buf_cluster = 0;
+    g_cluster_buf_dirty = 0;
+    g_fat_dirty_count = 0;
+    g_next_free_cluster = 2;
+    g_is_initialized = 0;
+
+    g_cluster_bytes = g_boot_sector.num_sectors_per_cluster * g_boot_sector.bytes_per_sector;
+    g_root_dir_sectors = (g_boot_sector.num_root_dir_entries * 32 + 511) / 512;
+    g_first_data_lba = g_partition_lba_offset + g_boot_sector.num_reserved_sectors +
+                       (g_boot_sector.num_fat_tables * g_boot_sector.num_sectors_per_fat) +
+                       g_root_dir_sectors;
+    g_fat_lba = fat_lba;
+    g_root_dir_lba = g_first_data_lba - g_root_dir_sectors;
+
+    uint32_t total_sectors = g_boot_sector.total_sectors ? g_boot_sector.total_sectors
+                                                         : g_boot_sector.total_sectors_in_fs;
+    uint32_t data_sectors = total_sectors - (g_first_data_lba - g_partition_lba_offset);
+    g_max_cluster = data_sectors / g_boot_sector.num_sectors_per_cluster + 1;
+    if (g_max_cluster > g_boot_sector.num_sectors_per_fat * 256 - 1) {
+        g_max_cluster = g_boot_sector.num_sectors_per_fat * 256 - 1;
+    }
 
-    if (ata_lba_read(fat_lba, g_fat_table, sectors_to_read) != 0) {
-        esp_printf(vga_putc, "Failed to read FAT table\n");
+    g_fat_table = kmalloc(g_boot_sector.num_sectors_per_fat * 512);
+    g_rde_buffer = kmalloc(g_root_dir_sectors * 512);
+    g_cluster_buf = kmalloc(g_cluster_bytes);
+    g_fat_dirty = kzalloc((g_boot_sector.num_sectors_per_fat + 7) / 8);
+    g_dir_hash_next = kmalloc(g_boot_sector.num_root_dir_entries * sizeof(uint16_t));
+    if (!g_fat_table || !g_rde_buffer || !g_cluster_buf || !g_fat_dirty || !g_dir_hash_next ||
+        bcache_init() != 0) {
+        log_err("Out of memory for FAT buffers\n");
         return -1;
     }
+
+    if (ata_read(fat_lba, g_fat_table, g_boot_sector.num_sectors_per_fat) != 0) {
+        log_err("Failed to read FAT table\n");
+        return -1;
+    }
+    if (bcache_read(g_root_dir_lba, g_rde_buffer, g_root_dir_sectors) != 0) {
+        log_err("Failed to read root directory\n");
+        return -1;
+    }
+    fat_dir_index_build();
+    fat_dcache_reset();
     g_is_initialized = 1;
-    g_next_file_handle = 0;
-    esp_printf(vga_putc, "FAT filesystem initialized successfully!\n\n");
+    for (int i = 0; i < FAT_MAX_OPEN_FILES; i++) {
+        g_file_in_use[i] = 0;
+    }
+    log_info("FAT filesystem initialized successfully!\n\n");
     return 0;
 }
 
 
-struct file* fatOpen(const char *filename) {
+static struct file* fat_open(const char *filename) {
     if (!g_is_initialized) {
-        esp_printf(vga_putc, "FAT not initialized\n");
+        log_err("FAT not initialized\n");
         return NULL;
     }
-    if (g_next_file_handle >= 8) {
-        esp_printf(vga_putc, "Too many open files\n");
+    int handle = 0;
+    while (handle < FAT_MAX_OPEN_FILES && g_file_in_use[handle]) {
+        handle++;
+    }
+    if (handle >= FAT_MAX_OPEN_FILES) {
+        log_warn("Too many open files\n");
         return NULL;
     }
-    char fat_name[8], fat_ext[3];
-    filename_to_fat(filename, fat_name, fat_ext);
+    log_debug("Opening file: %s\n", filename);
 
-    esp_printf(vga_putc, "Opening file: %s\n", filename);
+    struct fat_dirent ent;
+    if (fat_resolve(filename, &ent) == 0 && !(ent.rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)) {
+        struct file *f = &g_file_handles[handle];
+        g_file_in_use[handle] = 1;
+        memcpy(&f->rde, &ent.rde, sizeof(struct root_directory_entry));
+        f->start_cluster = ent.rde.cluster;
+        f->offset = 0;
+        f->cur_cluster = f->start_cluster;
+        f->cur_index = 0;
+        f->rde_lba = ent.lba;
+        f->rde_slot = ent.slot;
+        f->dirty = 0;
+        f->ra_expected = 0;
+        f->ra_window = 0;
+        f->ra_end = 0;
+        f->next = NULL;
+        f->prev = NULL;
 
+        log_debug("File opened successfully!\n");
+        log_debug("File size: %d bytes\n", f->rde.file_size);
+        log_debug("First cluster: %d\n\n", f->start_cluster);
 
-    uint32_t root_dir_lba = g_partition_lba_offset +
-                            g_boot_sector.num_reserved_sectors +
-                            (g_boot_sector.num_fat_tables * g_boot_sector.num_sectors_per_fat);
+        return f;
+    }
+    log_debug("File not found\n");
+    return NULL;
+}
 
 
-    uint32_t root_dir_sectors = (g_boot_sector.num_root_dir_entries * 32 + 511) / 512;
+static inline int fat_valid_handle(struct file *file) {
+    return file >= g_file_handles && file < g_file_handles + FAT_MAX_OPEN_FILES &&
+           g_file_in_use[file - g_file_handles];
+}
 
-    static uint8_t rde_buffer[32768];
+//Change a FAT16 entry in memory and remember which FAT sector it lives in
+static void fat_set(uint32_t cluster, uint16_t value) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t sector = cluster / 256;
 
-    if (ata_lba_read(root_dir_lba, rde_buffer, root_dir_sectors) != 0) {
-        esp_printf(vga_putc, "Failed to read root directory\n");
-        return NULL;
+    fat16[cluster] = value;
+    if (!(g_fat_dirty[sector / 8] & (1 << (sector % 8)))) {
+        g_fat_dirty[sector / 8] |= 1 << (sector % 8);
+        g_fat_dirty_count++;
     }
-    struct root_directory_entry *rde_tbl = (struct root_directory_entry *)rde_buffer;
-
+}
 
-    for (uint32_t i = 0; i < g_boot_sector.num_root_dir_entries; i++) {
+//Write the dirty FAT sectors to every FAT copy, one request per run of
+//adjacent dirty sectors
+static int fat_flush_table(void) {
+    uint32_t spf = g_boot_sector.num_sectors_per_fat;
+    uint32_t s = 0;
 
-        if (rde_tbl[i].file_name[0] == 0x00) {
-            break;  
+    if (g_fat_dirty_count == 0) {
+        return 0;
+    }
+    while (s < spf) {
+        if (!(g_fat_dirty[s / 8] & (1 << (s % 8)))) {
+            s++;
+            continue;
+        }
+        uint32_t e = s + 1;
+        while (e < spf && (g_fat_dirty[e / 8] & (1 << (e % 8)))) {
+            e++;
         }
+        for (uint32_t copy = 0; copy < g_boot_sector.num_fat_tables; copy++) {
+            if (bcache_write(g_fat_lba + copy * spf + s, g_fat_table + s * 512, e - s) != 0) {
+                return -1;
+            }
+        }
+        for (; s < e; s++) {
+            g_fat_dirty[s / 8] &= ~(1 << (s % 8));
+        }
+    }
+    g_fat_dirty_count = 0;
+    return 0;
+}
 
-        
-        if (rde_tbl[i].file_name[0] == 0xE5) {
-            continue;
+//Grab a free cluster, mark it end of chain and link it after prev (if any)
+static uint32_t fat_alloc_cluster(uint32_t prev) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t nclusters = g_max_cluster - 1;
+    uint32_t c = g_next_free_cluster;
+
+    for (uint32_t n = 0; n < nclusters; n++, c++) {
+        if (c > g_max_cluster) {
+            c = 2;
         }
+        if (fat16[c] == 0) {
+            fat_set(c, FAT16_EOC);
+            if (prev) {
+                fat_set(prev, c);
+            }
+            g_next_free_cluster = c + 1;
+            return c;
+        }
+    }
+    return 0;
+}
 
-        
-        if (rde_tbl[i].attribute & (FILE_ATTRIBUTE_SUBDIRECTORY | 0x08)) {
-            continue;
+//Return a chain to the free pool
+static void fat_free_chain(uint32_t cluster) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+
+    while (cluster >= 2 && cluster <= g_max_cluster) {
+        uint32_t next = fat16[cluster];
+        fat_set(cluster, 0);
+        if (cluster < g_next_free_cluster) {
+            g_next_free_cluster = cluster;
         }
+        cluster = next;
+    }
+}
 
-        
-        if (memcmp_local(rde_tbl[i].file_name, fat_name, 8) == 0 &&
-            memcmp_local(rde_tbl[i].file_extension, fat_ext, 3) == 0) {
+//Write back the partially filled cluster held in the bounce buffer
+static int fat_flush_cluster_buf(void) {
+    if (!g_cluster_buf_dirty) {
+        return 0;
+    }
+    if (bcache_write(fat_cluster_lba(g_cluster_buf_cluster), g_cluster_buf,
+                     g_boot_sector.num_sectors_per_cluster) != 0) {
+        return -1;
+    }
+    g_cluster_buf_dirty = 0;
+    return 0;
+}
 
-        
-            struct file *f = &g_file_handles[g_next_file_handle++];
-            memcpy_local(&f->rde, &rde_tbl[i], sizeof(struct root_directory_entry));
-            f->start_cluster = rde_tbl[i].cluster;
-            f->next = NULL;
-            f->prev = NULL;
+//Write a file's directory entry back. Root entries update the resident
+//root directory first so the index sees them; cached dentries are
+//refreshed too.
+static int fat_flush_rde(struct file *file) {
+    if (!file->dirty) {
+        return 0;
+    }
 
-            esp_printf(vga_putc, "File opened successfully!\n");
-            esp_printf(vga_putc, "File size: %d bytes\n", f->rde.file_size);
-            esp_printf(vga_putc, "First cluster: %d\n\n", f->start_cluster);
+    if (file->rde_lba >= g_root_dir_lba && file->rde_lba < g_first_data_lba) {
+        uint8_t *sector = g_rde_buffer + (file->rde_lba - g_root_dir_lba) * 512;
+        struct root_directory_entry *rde = (struct root_directory_entry *)sector;
+        memcpy(&rde[file->rde_slot], &file->rde, sizeof(struct root_directory_entry));
+        if (bcache_write(file->rde_lba, sector, 1) != 0) {
+            return -1;
+        }
+    } else {
+        struct buf *b = bread(file->rde_lba);
+        if (!b) {
+            return -1;
+        }
+        struct root_directory_entry *rde = (struct root_directory_entry *)b->data;
+        memcpy(&rde[file->rde_slot], &file->rde, sizeof(struct root_directory_entry));
+        int ret = bwrite(b);
+        brelse(b);
+        if (ret != 0) {
+            return -1;
+        }
+    }
 
-            return f;
+    for (int i = 0; i < FAT_DCACHE_SIZE; i++) {
+        struct fat_dentry *d = &g_dcache[i];
+        if (d->in_use && !d->negative && d->ent.lba == file->rde_lba && d->ent.slot == file->rde_slot) {
+            memcpy(&d->ent.rde, &file->rde, sizeof(struct root_directory_entry));
         }
     }
-    esp_printf(vga_putc, "File not found\n");
-    return NULL;
+    file->dirty = 0;
+    return 0;
+}
+
+//Data first, then the FAT, then the directory entries that point into it
+static int fat_sync(void) {
+    if (!g_is_initialized) {
+        return -1;
+    }
+    //the drive's write cache is flushed after each step so the data is on
+    //the media before the FAT points at it, and the FAT before the entries
+    int ret = 0;
+    if (fat_flush_cluster_buf() != 0 || ata_flush() != 0) {
+        ret = -1;
+    }
+    if (fat_flush_table() != 0 || ata_flush() != 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < FAT_MAX_OPEN_FILES; i++) {
+        if (g_file_in_use[i] && fat_flush_rde(&g_file_handles[i]) != 0) {
+            ret = -1;
+        }
+    }
+    if (ata_flush() != 0) {
+        ret = -1;
+    }
+    return ret;
 }
 
+static void fat_close(struct file *file) {
+    if (!fat_valid_handle(file)) {
+        return;
+    }
+    fat_flush_cluster_buf();
+    fat_flush_table();
+    fat_flush_rde(file);
+    g_file_in_use[file - g_file_handles] = 0;
+}
 
-int fatRead(struct file *file, void *buffer, uint32_t size) {
+//Move file->cur_cluster to the cluster holding file->offset. Walks forward
+//from the remembered cluster, so sequential reads never rescan the chain.
+static uint32_t fat_position_cluster(struct file *file) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t index = file->offset / g_cluster_bytes;
+
+    if (index < file->cur_index) {
+        file->cur_cluster = file->start_cluster;
+        file->cur_index = 0;
+    }
+    while (file->cur_index < index && file->cur_cluster >= 2 && file->cur_cluster < 0xFFF8) {
+        file->cur_cluster = fat16[file->cur_cluster];
+        file->cur_index++;
+    }
+    return file->cur_cluster;
+}
+
+//Adjust the read-ahead window after a read that started at start, then
+//queue the clusters in the window that haven't been requested yet. The
+//window grows while reads follow each other and collapses on a jump.
+static void fat_readahead(struct file *file, uint32_t start) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t spc = g_boot_sector.num_sectors_per_cluster;
+    uint32_t max_window = FAT_RA_MAX_SECTORS / spc ? FAT_RA_MAX_SECTORS / spc : 1;
+
+    if (start != file->ra_expected) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        file->ra_expected = file->offset;
+        return;
+    }
+    file->ra_expected = file->offset;
+    file->ra_window = file->ra_window ? file->ra_window * 2 : 1;
+    if (file->ra_window > max_window) {
+        file->ra_window = max_window;
+    }
+
+    //clusters from the first one not touched yet up to the window's end
+    uint32_t from = (file->offset + g_cluster_bytes - 1) / g_cluster_bytes;
+    uint32_t to = from + file->ra_window;
+    uint32_t last = (file->rde.file_size + g_cluster_bytes - 1) / g_cluster_bytes;
+    if (to > last) {
+        to = last;
+    }
+    if (file->ra_end > from) {
+        from = file->ra_end;
+    }
+    if (from >= to || file->cur_index > from) {
+        return;
+    }
+    file->ra_end = to;
+
+    uint32_t cluster = file->cur_cluster;
+    for (uint32_t i = file->cur_index; i < from; i++) {
+        if (cluster < 2 || cluster > g_max_cluster) {
+            return;
+        }
+        cluster = fat16[cluster];
+    }
+
+    //one request per run of clusters that are contiguous on disk
+    uint32_t run_start = cluster, run = 0;
+    for (uint32_t i = from; i < to; i++) {
+        if (cluster < 2 || cluster > g_max_cluster) {
+            break;
+        }
+        if (run && (cluster != run_start + run || (run + 1) * spc > FAT_RA_MAX_SECTORS)) {
+            bcache_prefetch(fat_cluster_lba(run_start), run * spc);
+            run_start = cluster;
+            run = 0;
+        }
+        run++;
+        cluster = fat16[cluster];
+    }
+    if (run) {
+        bcache_prefetch(fat_cluster_lba(run_start), run * spc);
+    }
+}
+
+static int fat_read(struct file *file, void *buffer, uint32_t size) {
     if (!file || !g_is_initialized) {
         return -1;
     }
 
-    if (size > file->rde.file_size) {
-        size = file->rde.file_size;
+    if (file->offset >= file->rde.file_size) {
+        return 0;
+    }
+    if (size > file->rde.file_size - file->offset) {
+        size = file->rde.file_size - file->offset;
     }
     uint8_t *buf = (uint8_t *)buffer;
     uint32_t bytes_read = 0;
-    uint32_t current_cluster = file->start_cluster;
+    uint32_t start = file->offset;
 
+    //whole-cluster reads below bypass the bounce buffer
+    if (fat_flush_cluster_buf() != 0) {
+        return -1;
+    }
 
-    uint32_t root_dir_sectors = (g_boot_sector.num_root_dir_entries * 32 + 511) / 512;
-    uint32_t first_data_sector = g_boot_sector.num_reserved_sectors + (g_boot_sector.num_fat_tables * g_boot_sector.num_sectors_per_fat) +
-                                 root_dir_sectors;
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t spc = g_boot_sector.num_sectors_per_cluster;
 
-    static uint8_t cluster_buf[CLUSTER_SIZE];
+    while (size > 0) {
+        uint32_t current_cluster = fat_position_cluster(file);
+        if (current_cluster < 2 || current_cluster >= 0xFFF8) {
+            break;
+        }
+        uint32_t in_cluster = file->offset % g_cluster_bytes;
 
-    while (size > 0 && current_cluster < 0xFFF8) {
+        //Whole clusters go straight into the caller's buffer. Clusters that
+        //follow each other on disk are merged into one multi-sector read.
+        if (in_cluster == 0 && size >= g_cluster_bytes) {
+            uint32_t max_run = size / g_cluster_bytes;
+            if (max_run > FAT_MAX_READ_SECTORS / spc) {
+                max_run = FAT_MAX_READ_SECTORS / spc;
+            }
 
-        uint32_t cluster_lba = g_partition_lba_offset + first_data_sector + (current_cluster - 2) * g_boot_sector.num_sectors_per_cluster;
+            uint32_t last = current_cluster;
+            uint32_t run = 1;
+            while (run < max_run && fat16[last] == last + 1) {
+                last++;
+                run++;
+            }
 
-        if (ata_lba_read(cluster_lba, cluster_buf, g_boot_sector.num_sectors_per_cluster) != 0) {
-            return -1;
+            if (bcache_read(fat_cluster_lba(current_cluster), buf + bytes_read, run * spc) != 0) {
+                return -1;
+            }
+
+            //Leave the chain position on the last cluster of the run
+            file->cur_cluster = last;
+            file->cur_index += run - 1;
+
+            bytes_read += run * g_cluster_bytes;
+            size -= run * g_cluster_bytes;
+            file->offset += run * g_cluster_bytes;
+            continue;
         }
 
-        uint32_t bytes_to_copy = (size < CLUSTER_SIZE) ? size : CLUSTER_SIZE;
-        if (bytes_to_copy > (file->rde.file_size - bytes_read)) {
-            bytes_to_copy = file->rde.file_size - bytes_read;
+        //Partial head or tail cluster goes through the bounce buffer. A
+        //cluster is only read once even if it is consumed in pieces.
+        if (current_cluster != g_cluster_buf_cluster) {
+            if (bcache_read(fat_cluster_lba(current_cluster), g_cluster_buf, spc) != 0) {
+                g_cluster_buf_cluster = 0;
+                return -1;
+            }
+            g_cluster_buf_cluster = current_cluster;
         }
-        memcpy_local(buf + bytes_read, cluster_buf, bytes_to_copy);
+
+        uint32_t bytes_to_copy = g_cluster_bytes - in_cluster;
+        if (bytes_to_copy > size) {
+            bytes_to_copy = size;
+        }
+        memcpy(buf + bytes_read, g_cluster_buf + in_cluster, bytes_to_copy);
 
         bytes_read += bytes_to_copy;
         size -= bytes_to_copy;
+        file->offset += bytes_to_copy;
+    }
+
+    fat_readahead(file, start);
+    return bytes_read;
+}
+
+//Set the position of the next read. Returns the new offset or -1.
+static int fat_seek(struct file *file, int32_t offset, int whence) {
+    if (!file || !g_is_initialized) {
+        return -1;
+    }
+
+    int32_t base;
+    switch (whence) {
+    case FAT_SEEK_SET: base = 0; break;
+    case FAT_SEEK_CUR: base = (int32_t)file->offset; break;
+    case FAT_SEEK_END: base = (int32_t)file->rde.file_size; break;
+    default: return -1;
+    }
+
+    int32_t pos = base + offset;
+    if (pos < 0 || (uint32_t)pos > file->rde.file_size) {
+        return -1;
+    }
+
+    //cur_cluster is fixed up lazily by the next read
+    file->offset = (uint32_t)pos;
+    return pos;
+}
 
+//Move file->cur_cluster to the cluster holding file->offset, growing the
+//chain when the offset sits just past its end. Returns 0 if the volume is
+//full.
+static uint32_t fat_position_cluster_for_write(struct file *file) {
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t index = file->offset / g_cluster_bytes;
 
-        if (size > 0) {
-            uint16_t *fat16 = (uint16_t *)g_fat_table;
-            current_cluster = fat16[current_cluster];
+    if (file->start_cluster == 0) {
+        file->start_cluster = fat_alloc_cluster(0);
+        if (file->start_cluster == 0) {
+            return 0;
+        }
+        file->rde.cluster = (uint16_t)file->start_cluster;
+        file->dirty = 1;
+        file->cur_cluster = file->start_cluster;
+        file->cur_index = 0;
+    }
+    //a read that ran off the end of the chain leaves cur_cluster invalid
+    if (index < file->cur_index || file->cur_cluster < 2 || file->cur_cluster > g_max_cluster) {
+        file->cur_cluster = file->start_cluster;
+        file->cur_index = 0;
+    }
+    while (file->cur_index < index) {
+        uint32_t next = fat16[file->cur_cluster];
+        if (next < 2 || next > g_max_cluster) {
+            next = fat_alloc_cluster(file->cur_cluster);
+            if (next == 0) {
+                return 0;
+            }
         }
+        file->cur_cluster = next;
+        file->cur_index++;
     }
+    return file->cur_cluster;
+}
 
-    return bytes_read;
+//Write at the current offset, extending the file as needed. Returns the
+//number of bytes written, which is short if the volume fills up.
+static int fat_write(struct file *file, const void *buffer, uint32_t size) {
+    if (!fat_valid_handle(file) || !g_is_initialized) {
+        return -1;
+    }
+    if (file->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) {
+        return -1;
+    }
+
+    const uint8_t *buf = (const uint8_t *)buffer;
+    uint32_t bytes_written = 0;
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint32_t spc = g_boot_sector.num_sectors_per_cluster;
+
+    while (size > 0) {
+        uint32_t current_cluster = fat_position_cluster_for_write(file);
+        if (current_cluster == 0) {
+            log_err("FAT volume full\n");
+            break;
+        }
+        uint32_t in_cluster = file->offset % g_cluster_bytes;
+
+        //Whole clusters are written straight from the caller's buffer, one
+        //request per run of clusters that are contiguous on disk
+        if (in_cluster == 0 && size >= g_cluster_bytes) {
+            uint32_t max_run = size / g_cluster_bytes;
+            if (max_run > FAT_MAX_READ_SECTORS / spc) {
+                max_run = FAT_MAX_READ_SECTORS / spc;
+            }
+
+            uint32_t last = current_cluster;
+            uint32_t run = 1;
+            while (run < max_run) {
+                uint32_t next = fat16[last];
+                if (next < 2 || next > g_max_cluster) {
+                    //past the end of the chain: extend it, hopefully in place
+                    next = fat_alloc_cluster(last);
+                    if (next == 0) {
+                        break;
+                    }
+                }
+                if (next != last + 1) {
+                    break;
+                }
+                last++;
+                run++;
+            }
+
+            if (g_cluster_buf_cluster >= current_cluster && g_cluster_buf_cluster <= last) {
+                g_cluster_buf_cluster = 0;      //about to be overwritten on disk
+                g_cluster_buf_dirty = 0;
+            }
+            if (bcache_write(fat_cluster_lba(current_cluster), buf + bytes_written, run * spc) != 0) {
+                return -1;
+            }
+
+            file->cur_cluster = last;
+            file->cur_index += run - 1;
+
+            bytes_written += run * g_cluster_bytes;
+            size -= run * g_cluster_bytes;
+            file->offset += run * g_cluster_bytes;
+        } else {
+            //Partial clusters are assembled in the bounce buffer and only
+            //written when another cluster is needed or at sync/close, so
+            //small appends don't each cost a disk write
+            if (current_cluster != g_cluster_buf_cluster) {
+                if (fat_flush_cluster_buf() != 0) {
+                    return -1;
+                }
+                //a cluster with no file data in it yet needn't be read
+                if (file->offset - in_cluster >= file->rde.file_size) {
+                    memset(g_cluster_buf, 0, g_cluster_bytes);
+                } else if (bcache_read(fat_cluster_lba(current_cluster), g_cluster_buf, spc) != 0) {
+                    g_cluster_buf_cluster = 0;
+                    return -1;
+                }
+                g_cluster_buf_cluster = current_cluster;
+            }
+
+            uint32_t bytes_to_copy = g_cluster_bytes - in_cluster;
+            if (bytes_to_copy > size) {
+                bytes_to_copy = size;
+            }
+            memcpy(g_cluster_buf + in_cluster, buf + bytes_written, bytes_to_copy);
+            g_cluster_buf_dirty = 1;
+
+            bytes_written += bytes_to_copy;
+            size -= bytes_to_copy;
+            file->offset += bytes_to_copy;
+        }
+
+        if (file->offset > file->rde.file_size) {
+            file->rde.file_size = file->offset;
+            file->dirty = 1;
+        }
+    }
+
+    return bytes_written;
+}
+
+//Shrink a file to size bytes, freeing the clusters past the new end
+static int fat_truncate(struct file *file, uint32_t size) {
+    if (!fat_valid_handle(file) || !g_is_initialized) {
+        return -1;
+    }
+    if (size > file->rde.file_size) {
+        return -1;
+    }
+    if (size == file->rde.file_size) {
+        return 0;
+    }
+
+    //the bounce buffer may hold one of the clusters being freed
+    if (fat_flush_cluster_buf() != 0) {
+        return -1;
+    }
+    g_cluster_buf_cluster = 0;
+
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    if (size == 0) {
+        fat_free_chain(file->start_cluster);
+        file->start_cluster = 0;
+        file->rde.cluster = 0;
+    } else {
+        uint32_t last = file->start_cluster;
+        for (uint32_t i = 1; i < (size + g_cluster_bytes - 1) / g_cluster_bytes; i++) {
+            last = fat16[last];
+        }
+        fat_free_chain(fat16[last]);
+        fat_set(last, FAT16_EOC);
+    }
+
+    file->rde.file_size = size;
+    file->dirty = 1;
+    if (file->offset > size) {
+        file->offset = size;
+    }
+    file->cur_cluster = file->start_cluster;
+    file->cur_index = 0;
+    return 0;
+}
+
+//Open filename for writing: an existing file is truncated, otherwise a new
+//entry is made in the first free root directory slot
+static struct file *fat_create(const char *filename) {
+    if (!g_is_initialized) {
+        log_err("FAT not initialized\n");
+        return NULL;
+    }
+
+    while (*filename == '/') {
+        filename++;
+    }
+    for (const char *p = filename; *p; p++) {
+        if (*p == '/') {
+            log_warn("Files can only be created in the root directory\n");
+            return NULL;
+        }
+    }
+    if (!fat_is_short_name(filename)) {
+        log_warn("New files need an 8.3 name\n");
+        return NULL;
+    }
+
+    //only a name that is really not there gets a new entry; anything else
+    //would leave two entries with the same name
+    struct fat_dirent ent;
+    int err = fat_resolve(filename, &ent);
+    if (err == FAT_LOOKUP_EIO) {
+        log_err("Can't read the directory to create %s\n", filename);
+        return NULL;
+    }
+    if (err == 0) {
+        if (ent.rde.attribute & (FILE_ATTRIBUTE_SUBDIRECTORY | FILE_ATTRIBUTE_VOLUME_LABEL)) {
+            log_warn("%s exists and is not a file\n", filename);
+            return NULL;
+        }
+        struct file *f = fat_open(filename);
+        if (!f) {
+            return NULL;
+        }
+        if (fat_truncate(f, 0) != 0) {
+            fat_close(f);
+            return NULL;
+        }
+        return f;
+    }
+
+    int handle = 0;
+    while (handle < FAT_MAX_OPEN_FILES && g_file_in_use[handle]) {
+        handle++;
+    }
+    if (handle >= FAT_MAX_OPEN_FILES) {
+        log_warn("Too many open files\n");
+        return NULL;
+    }
+
+    struct root_directory_entry *rde_tbl = (struct root_directory_entry *)g_rde_buffer;
+    uint32_t i;
+    for (i = 0; i < g_boot_sector.num_root_dir_entries; i++) {
+        if (rde_tbl[i].file_name[0] == 0x00 || (uint8_t)rde_tbl[i].file_name[0] == 0xE5) {
+            break;
+        }
+    }
+    if (i >= g_boot_sector.num_root_dir_entries) {
+        log_err("Root directory full\n");
+        return NULL;
+    }
+
+    struct file *f = &g_file_handles[handle];
+    g_file_in_use[handle] = 1;
+    memset(&f->rde, 0, sizeof(struct root_directory_entry));
+    filename_to_fat(filename, f->rde.file_name, f->rde.file_extension);
+    f->rde.attribute = 0x20;                //archive
+    f->start_cluster = 0;
+    f->offset = 0;
+    f->cur_cluster = 0;
+    f->cur_index = 0;
+    f->rde_lba = g_root_dir_lba + i / 16;
+    f->rde_slot = i % 16;
+    f->dirty = 1;
+    f->ra_expected = 0;
+    f->ra_window = 0;
+    f->ra_end = 0;
+    f->next = NULL;
+    f->prev = NULL;
+
+    //claim the slot now so a second create can't reuse it
+    if (fat_flush_rde(f) != 0) {
+        g_file_in_use[handle] = 0;
+        return NULL;
+    }
+    fat_dir_index_insert(i);
+
+    //forget cached misses in the root, this name may have been one
+    for (int k = 0; k < FAT_DCACHE_SIZE; k++) {
+        if (g_dcache[k].in_use && g_dcache[k].negative && g_dcache[k].parent == 0) {
+            fat_dcache_unhash(&g_dcache[k]);
+        }
+    }
+    log_debug("Created file: %s\n", filename);
+    return f;
+}
+
+//Page fault callback for a mapping: load the sectors backing one page and
+//zero whatever lies past the end of the file
+static int fat_mmap_load(void *priv, uint32_t offset, void *frame) {
+    struct fat_mapping *m = (struct fat_mapping *)priv;
+    uint16_t *fat16 = (uint16_t *)g_fat_table;
+    uint8_t *dst = (uint8_t *)frame;
+    uint32_t valid = 0;
+
+    //the disk is current except for a partially written cluster
+    if (fat_flush_cluster_buf() != 0) {
+        return -1;
+    }
+
+    if (offset < m->file_size) {
+        valid = m->file_size - offset;
+        if (valid > PAGE_SIZE_BYTES) {
+            valid = PAGE_SIZE_BYTES;
+        }
+    }
+
+    uint32_t done = 0;
+    while (done < valid) {
+        uint32_t pos = offset + done;
+        uint32_t index = pos / g_cluster_bytes;
+        if (index < m->cur_index) {
+            m->cur_cluster = m->start_cluster;
+            m->cur_index = 0;
+        }
+        while (m->cur_index < index) {
+            m->cur_cluster = fat16[m->cur_cluster];
+            m->cur_index++;
+        }
+        if (m->cur_cluster < 2 || m->cur_cluster > g_max_cluster) {
+            return -1;
+        }
+
+        uint32_t in_cluster = pos % g_cluster_bytes;
+        uint32_t bytes = g_cluster_bytes - in_cluster;
+        if (bytes > PAGE_SIZE_BYTES - done) {
+            bytes = PAGE_SIZE_BYTES - done;
+        }
+        if (bytes > valid - done) {
+            bytes = (valid - done + 511) & ~511u;
+        }
+        if (ata_read(fat_cluster_lba(m->cur_cluster) + in_cluster / 512, dst + done, bytes / 512) != 0) {
+            return -1;
+        }
+        done += bytes;
+    }
+
+    memset(dst + valid, 0, PAGE_SIZE_BYTES - valid);
+    return 0;
+}
+
+static int fat_mmap_fill(void *priv, uint32_t offset, void *frame) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_mmap_load(priv, offset, frame);
+    fat_leave();
+    return err;
+}
+
+//Map len bytes of a file at vaddr (page aligned). Nothing is read until a
+//page is touched. Returns vaddr, or NULL if the range can't be reserved.
+static void *fat_mmap(struct file *file, void *vaddr, uint32_t len) {
+    if (!fat_valid_handle(file) || !g_is_initialized || len == 0 ||
+        ((uint32_t)vaddr & (PAGE_SIZE_BYTES - 1))) {
+        return NULL;
+    }
+
+    struct fat_mapping *m = NULL;
+    for (int i = 0; i < FAT_MAX_MAPPINGS; i++) {
+        if (!g_mappings[i].in_use) {
+            m = &g_mappings[i];
+            break;
+        }
+    }
+    if (!m) {
+        log_warn("Too many mappings\n");
+        return NULL;
+    }
+
+    m->vaddr = (uint32_t)vaddr;
+    m->npages = (len + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    m->start_cluster = file->start_cluster;
+    m->file_size = file->rde.file_size;
+    m->cur_cluster = m->start_cluster;
+    m->cur_index = 0;
+
+    if (reserve_pages(vaddr, m->npages, pd) != 0 ||
+        register_fault_range(vaddr, m->npages * PAGE_SIZE_BYTES, fat_mmap_fill, m) != 0) {
+        log_warn("Can't reserve %x for mapping\n", vaddr);
+        return NULL;
+    }
+    m->in_use = 1;
+    return vaddr;
+}
+
+//Tear down a mapping made by fatMmap and free the pages it faulted in
+static int fat_munmap(void *vaddr) {
+    for (int i = 0; i < FAT_MAX_MAPPINGS; i++) {
+        struct fat_mapping *m = &g_mappings[i];
+        if (!m->in_use || m->vaddr != (uint32_t)vaddr) {
+            continue;
+        }
+
+        unregister_fault_range(vaddr);
+        for (uint32_t p = 0; p < m->npages; p++) {
+            void *frame = unmap_page((uint8_t *)vaddr + p * PAGE_SIZE_BYTES, pd);
+            if (frame) {
+                struct ppage *pg = phys_to_ppage(frame);
+                pg->next = NULL;
+                free_physical_pages(pg);
+            }
+        }
+        m->in_use = 0;
+        return 0;
+    }
+    return -1;
+}
+
+//Public entry points, each one call under fat_lock. Calls from CPUs other
+//than the bootstrap processor fail.
+
+int fatInit(void) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_init();
+    fat_leave();
+    return err;
+}
+
+struct file *fatOpen(const char *filename) {
+    if (fat_enter() < 0)
+        return NULL;
+    struct file *f = fat_open(filename);
+    fat_leave();
+    return f;
+}
+
+int fatRead(struct file *file, void *buffer, uint32_t size) {
+    if (fat_enter() < 0)
+        return -1;
+    int n = fat_read(file, buffer, size);
+    fat_leave();
+    return n;
+}
+
+int fatSeek(struct file *file, int32_t offset, int whence) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_seek(file, offset, whence);
+    fat_leave();
+    return err;
+}
+
+void fatClose(struct file *file) {
+    if (fat_enter() < 0)
+        return;
+    fat_close(file);
+    fat_leave();
+}
+
+struct file *fatCreate(const char *filename) {
+    if (fat_enter() < 0)
+        return NULL;
+    struct file *f = fat_create(filename);
+    fat_leave();
+    return f;
+}
+
+int fatWrite(struct file *file, const void *buffer, uint32_t size) {
+    if (fat_enter() < 0)
+        return -1;
+    int n = fat_write(file, buffer, size);
+    fat_leave();
+    return n;
+}
+
+int fatTruncate(struct file *file, uint32_t size) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_truncate(file, size);
+    fat_leave();
+    return err;
+}
+
+int fatSync(void) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_sync();
+    fat_leave();
+    return err;
+}
+
+void *fatMmap(struct file *file, void *vaddr, uint32_t len) {
+    if (fat_enter() < 0)
+        return NULL;
+    void *p = fat_mmap(file, vaddr, len);
+    fat_leave();
+    return p;
+}
+
+int fatMunmap(void *vaddr) {
+    if (fat_enter() < 0)
+        return -1;
+    int err = fat_munmap(vaddr);
+    fat_leave();
+    return err;
 }
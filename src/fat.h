@@ -4,10 +4,12 @@
 
 #include <stdint.h>
 
-#define CLUSTER_SIZE 4096
-#define SECTORS_PER_CLUSTER (CLUSTER_SIZE/SECTOR_SIZE)
-
 #define FILE_ATTRIBUTE_SUBDIRECTORY 0x10
+#define FILE_ATTRIBUTE_VOLUME_LABEL 0x08
+#define FILE_ATTRIBUTE_LFN          0x0F
+
+//Longest long file name, in characters
+#define FAT_LFN_MAX 255
 
 /*
  * Data structure definitions.
@@ -67,6 +69,27 @@ struct root_directory_entry {
     uint32_t file_size;
 };
 
+/*
+ * VFAT long file name entry. A long name is stored as a run of these
+ * directly before the 8.3 entry it belongs to, last piece first. Each piece
+ * carries 13 UCS-2 characters.
+ *
+ */
+struct lfn_entry {
+    uint8_t order;              // sequence number, 0x40 marks the last piece
+    uint16_t name1[5];
+    uint8_t attribute;          // always FILE_ATTRIBUTE_LFN
+    uint8_t type;
+    uint8_t checksum;           // checksum of the 8.3 name
+    uint16_t name2[6];
+    uint16_t cluster;           // always 0
+    uint16_t name3[2];
+}__attribute__((packed));
+
+#define LFN_LAST_ENTRY  0x40
+#define LFN_ORDER_MASK  0x1F
+#define LFN_CHARS       13
+
 /*
  *
  * Stores info about an open file
@@ -77,7 +100,53 @@ struct file {
     struct file *prev;
     struct root_directory_entry rde;
     uint32_t start_cluster;
+    uint32_t offset;        // byte position of the next read or write
+    uint32_t cur_cluster;   // cluster holding offset, remembered between reads
+    uint32_t cur_index;     // position of cur_cluster in the cluster chain
+    uint32_t rde_lba;       // sector holding the directory entry
+    uint32_t rde_slot;      // entry within that sector
+    uint8_t dirty;          // rde changed and must be written back
+    uint32_t ra_expected;   // offset a sequential read would start at
+    uint32_t ra_window;     // read-ahead window in clusters, 0 when random
+    uint32_t ra_end;        // cluster index read-ahead has been issued up to
 };
 
+#define FAT_SEEK_SET 0
+#define FAT_SEEK_CUR 1
+#define FAT_SEEK_END 2
+
+int fatInit(void);
+
+//filename is a path such as "/boot/grub.cfg"; components may be long names
+struct file *fatOpen(const char *filename);
+int fatRead(struct file *file, void *buffer, uint32_t size);
+int fatSeek(struct file *file, int32_t offset, int whence);
+void fatClose(struct file *file);
+
+/*
+ * Write support. fatCreate opens a file for writing, creating it or
+ * truncating an existing one. New files can only be made in the root
+ * directory. Writes happen at the current offset, so
+ * appending is fatSeek(f, 0, FAT_SEEK_END) followed by fatWrite.
+ *
+ * FAT changes are kept in memory and only the modified FAT sectors are
+ * written, to every FAT copy, by fatSync or fatClose.
+ *
+ */
+struct file *fatCreate(const char *filename);
+int fatWrite(struct file *file, const void *buffer, uint32_t size);
+int fatTruncate(struct file *file, uint32_t size);
+int fatSync(void);
+
+/*
+ * Memory mapped files. fatMmap reserves a page aligned virtual range and
+ * pages are loaded from disk by the page fault handler on first access.
+ * The mapping sees the file as it was when mapped and is read-mostly:
+ * stores to it are never written back.
+ *
+ */
+void *fatMmap(struct file *file, void *vaddr, uint32_t len);
+int fatMunmap(void *vaddr);
+
 
 #endif
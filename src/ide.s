@@ -183,3 +183,101 @@ ata_lba_read:
     ret
 
 
+
+
+;=============================================================================
+; ATA write sectors (LBA mode)
+;
+; C Prototype:
+; ata_lba_write(unsigned int lba, unsigned char *buffer, unsigned int numsectors)
+;
+; Same stack layout as ata_lba_read, the buffer is the source. The drive's
+; write cache is flushed (command E7h) before returning.
+;
+;=============================================================================
+    global ata_lba_write
+ata_lba_write:
+    push ebp
+    mov ebp,esp
+    push ebx
+    push ecx
+    push edx
+    push esi
+
+    mov edx, 0x03F6      ; Digital output register
+    mov al,2             ; Disable interrupts
+    out dx,al
+
+    mov eax,[8+ebp]      ; Get LBA in EAX
+    mov esi,[12+ebp]     ; Get buffer in ESI
+    mov ecx,[16+ebp]     ; Get sector count in ECX
+    and eax, 0x0FFFFFFF
+    mov ebx, eax         ; Save LBA in EBX
+
+    mov edx, 0x01F6      ; Port to send drive and bit 24 - 27 of LBA
+    shr eax, 24          ; Get bit 24 - 27 in al
+    or al, 11100000b     ; Set bit 6 in al for LBA mode
+    out dx, al
+
+    mov edx, 0x01F2      ; Port to send number of sectors
+    mov al, cl           ; Get number of sectors from CL
+    out dx, al
+
+    mov edx, 0x1F3       ; Port to send bit 0 - 7 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    out dx, al
+
+    mov edx, 0x1F4       ; Port to send bit 8 - 15 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    shr eax, 8           ; Get bit 8 - 15 in AL
+    out dx, al
+
+    mov edx, 0x1F5       ; Port to send bit 16 - 23 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    shr eax, 16          ; Get bit 16 - 23 in AL
+    out dx, al
+
+    mov edx, 0x1F7       ; Command port
+    mov al, 0x30         ; Write with retry.
+    out dx, al
+
+; wait for BSY clear, then DRQ set (or ERR/DF) before every sector
+.piow_l:
+    in al, dx       ; grab a status byte
+    test al, 0x80       ; BSY flag set?
+    jne short .piow_l
+    test al, 0x21       ; ERR or DF set?
+    jne short .wfail
+    test al, 8      ; DRQ set?
+    je short .piow_l
+
+    mov edx, 0x1F0       ; Data port
+    mov ecx, 256
+    rep outsw       ; push one 512b sector from esi
+    mov edx, 0x1F7
+
+    dec long [16+ebp]           ; decrement the "sectors to write" count
+    jne short .piow_l
+
+    mov al, 0xE7         ; Cache flush
+    out dx, al
+.flush_l:
+    in al, dx
+    test al, 0x80
+    jne short .flush_l
+    test al, 0x21
+    jne short .wfail
+
+    xor eax,eax
+    jmp short .wdone
+
+.wfail:
+    mov eax,-1
+
+.wdone:
+    pop esi
+    pop edx
+    pop ecx
+    pop ebx
+    leave
+    ret
@@ -0,0 +1,224 @@
+#include "interrupt.h"
+#include "io.h"
+#include "log.h"
+#include "rprintf.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI   0x20
+
+#define NUM_STUBS 48
+
+//Flat 4 GiB code and data segments. GRUB's GDT lives in memory we don't
+//own, so we load our own before installing the IDT.
+static uint64_t gdt[3] __attribute__((aligned(8))) = {
+    0,
+    0x00CF9A000000FFFFull,      // 0x08 ring 0 code
+    0x00CF92000000FFFFull,      // 0x10 ring 0 data
+};
+
+struct descriptor_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+struct idt_gate {
+    uint16_t offset_lo;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_hi;
+} __attribute__((packed));
+
+static struct idt_gate idt[256] __attribute__((aligned(8)));
+static interrupt_handler_t handlers[256];
+
+//Entry stubs. Vectors where the CPU does not push an error code push a
+//dummy 0 so every frame has the same layout.
+#define ISR_NOERR(n) ".global isr" #n "\nisr" #n ":\n    push $0\n    push $" #n "\n    jmp isr_common\n"
+#define ISR_ERR(n)   ".global isr" #n "\nisr" #n ":\n    push $" #n "\n    jmp isr_common\n"
+
+__asm__(
+    ".text\n"
+    ISR_NOERR(0)  ISR_NOERR(1)  ISR_NOERR(2)  ISR_NOERR(3)
+    ISR_NOERR(4)  ISR_NOERR(5)  ISR_NOERR(6)  ISR_NOERR(7)
+    ISR_ERR(8)    ISR_NOERR(9)  ISR_ERR(10)   ISR_ERR(11)
+    ISR_ERR(12)   ISR_ERR(13)   ISR_ERR(14)   ISR_NOERR(15)
+    ISR_NOERR(16) ISR_ERR(17)   ISR_NOERR(18) ISR_NOERR(19)
+    ISR_NOERR(20) ISR_ERR(21)   ISR_NOERR(22) ISR_NOERR(23)
+    ISR_NOERR(24) ISR_NOERR(25) ISR_NOERR(26) ISR_NOERR(27)
+    ISR_NOERR(28) ISR_NOERR(29) ISR_ERR(30)   ISR_NOERR(31)
+    ISR_NOERR(32) ISR_NOERR(33) ISR_NOERR(34) ISR_NOERR(35)
+    ISR_NOERR(36) ISR_NOERR(37) ISR_NOERR(38) ISR_NOERR(39)
+    ISR_NOERR(40) ISR_NOERR(41) ISR_NOERR(42) ISR_NOERR(43)
+    ISR_NOERR(44) ISR_NOERR(45) ISR_NOERR(46) ISR_NOERR(47)
+    ISR_NOERR(240) ISR_NOERR(255)
+    "isr_common:\n"
+    "    pusha\n"
+    "    cld\n"
+    "    push %esp\n"
+    "    call interrupt_dispatch\n"
+    "    add $4, %esp\n"
+    "    popa\n"
+    "    add $8, %esp\n"
+    "    iret\n");
+
+#define ISR_ENTRY(n) ".long isr" #n "\n"
+__asm__(
+    ".data\n"
+    ".global isr_stub_table\n"
+    "isr_stub_table:\n"
+    ISR_ENTRY(0)  ISR_ENTRY(1)  ISR_ENTRY(2)  ISR_ENTRY(3)  ISR_ENTRY(4)  ISR_ENTRY(5)
+    ISR_ENTRY(6)  ISR_ENTRY(7)  ISR_ENTRY(8)  ISR_ENTRY(9)  ISR_ENTRY(10) ISR_ENTRY(11)
+    ISR_ENTRY(12) ISR_ENTRY(13) ISR_ENTRY(14) ISR_ENTRY(15) ISR_ENTRY(16) ISR_ENTRY(17)
+    ISR_ENTRY(18) ISR_ENTRY(19) ISR_ENTRY(20) ISR_ENTRY(21) ISR_ENTRY(22) ISR_ENTRY(23)
+    ISR_ENTRY(24) ISR_ENTRY(25) ISR_ENTRY(26) ISR_ENTRY(27) ISR_ENTRY(28) ISR_ENTRY(29)
+    ISR_ENTRY(30) ISR_ENTRY(31) ISR_ENTRY(32) ISR_ENTRY(33) ISR_ENTRY(34) ISR_ENTRY(35)
+    ISR_ENTRY(36) ISR_ENTRY(37) ISR_ENTRY(38) ISR_ENTRY(39) ISR_ENTRY(40) ISR_ENTRY(41)
+    ISR_ENTRY(42) ISR_ENTRY(43) ISR_ENTRY(44) ISR_ENTRY(45) ISR_ENTRY(46) ISR_ENTRY(47)
+    ".text\n");
+
+extern uint32_t isr_stub_table[NUM_STUBS];
+extern char isr240[], isr255[];
+
+static const char *exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range",
+    "Invalid opcode", "Device not available", "Double fault", "Coprocessor overrun",
+    "Invalid TSS", "Segment not present", "Stack fault", "General protection",
+    "Page fault", "Reserved", "x87 error", "Alignment check", "Machine check",
+    "SIMD error", "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved", "Reserved", "Reserved",
+    "Security", "Reserved",
+};
+
+static void gdt_init(void) {
+    struct descriptor_ptr gdtr = { sizeof(gdt) - 1, (uint32_t)gdt };
+
+    __asm__ __volatile__(
+        "lgdt %0\n\t"
+        "ljmp %1, $1f\n"
+        "1:\n\t"
+        "mov %2, %%ax\n\t"
+        "mov %%ax, %%ds\n\t"
+        "mov %%ax, %%es\n\t"
+        "mov %%ax, %%fs\n\t"
+        "mov %%ax, %%gs\n\t"
+        "mov %%ax, %%ss\n\t"
+        :: "m"(gdtr), "i"(KERNEL_CODE_SELECTOR), "i"(KERNEL_DATA_SELECTOR)
+        : "eax", "memory");
+}
+
+static void idt_set_gate(uint8_t vector, uint32_t handler) {
+    idt[vector].offset_lo = handler & 0xFFFF;
+    idt[vector].selector = KERNEL_CODE_SELECTOR;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = 0x8E;       // present, ring 0, 32-bit interrupt gate
+    idt[vector].offset_hi = (handler >> 16) & 0xFFFF;
+}
+
+//Move IRQ 0-7 to vectors 32-39 and IRQ 8-15 to 40-47, all masked except
+//the cascade line
+static void pic_remap(void) {
+    outb(PIC1_CMD, 0x11);               // ICW1: init, expect ICW4
+    io_wait();
+    outb(PIC2_CMD, 0x11);
+    io_wait();
+    outb(PIC1_DATA, IRQ_BASE_VECTOR);   // ICW2: vector offsets
+    io_wait();
+    outb(PIC2_DATA, IRQ_BASE_VECTOR + 8);
+    io_wait();
+    outb(PIC1_DATA, 4);                 // ICW3: slave on IRQ2
+    io_wait();
+    outb(PIC2_DATA, 2);
+    io_wait();
+    outb(PIC1_DATA, 0x01);              // ICW4: 8086 mode
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+
+    outb(PIC1_DATA, 0xFF & ~(1 << IRQ_CASCADE));
+    outb(PIC2_DATA, 0xFF);
+}
+
+void pic_unmask_irq(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_mask_irq(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+static void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8)
+        outb(PIC2_CMD, PIC_EOI);
+    outb(PIC1_CMD, PIC_EOI);
+}
+
+void register_interrupt_handler(uint8_t vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+//Called from isr_common with interrupts disabled
+void interrupt_dispatch(struct interrupt_frame *frame) {
+    uint32_t vector = frame->vector;
+
+    if (vector >= IRQ_BASE_VECTOR && vector < IRQ_BASE_VECTOR + 16) {
+        //acknowledge first so a handler that switches threads doesn't
+        //leave the PIC waiting
+        pic_send_eoi(vector - IRQ_BASE_VECTOR);
+        if (handlers[vector])
+            handlers[vector](frame);
+        return;
+    }
+
+    if (handlers[vector]) {
+        handlers[vector](frame);
+        return;
+    }
+
+    unhandled_exception(frame);
+}
+
+//Report an exception nobody could handle and stop. Exception handlers
+//call this for the cases they don't deal with.
+void unhandled_exception(struct interrupt_frame *frame) {
+    uint32_t vector = frame->vector;
+
+    //whatever was logged before the crash is the most useful part
+    log_drain();
+    esp_sink_printf(vga_sink, NULL, "\nException %d (%s), error %x at eip %x\n",
+                    vector, vector < 32 ? exception_names[vector] : "unknown",
+                    frame->error_code, frame->eip);
+    for (;;)
+        __asm__ __volatile__("cli; hlt");
+}
+
+static void idt_load(void) {
+    struct descriptor_ptr idtr = { sizeof(idt) - 1, (uint32_t)idt };
+    __asm__ __volatile__("lidt %0" :: "m"(idtr));
+}
+
+void interrupts_init(void) {
+    gdt_init();
+
+    for (int i = 0; i < NUM_STUBS; i++)
+        idt_set_gate(i, isr_stub_table[i]);
+    idt_set_gate(IPI_VECTOR, (uint32_t)isr240);
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)isr255);
+
+    idt_load();
+    pic_remap();
+}
+
+//An application processor shares the GDT and IDT; it only has to load them
+void interrupts_init_ap(void) {
+    gdt_init();
+    idt_load();
+}
@@ -0,0 +1,70 @@
+#ifndef __INTERRUPT_H__
+#define __INTERRUPT_H__
+
+#include <stdint.h>
+
+/*
+ * GDT, IDT and 8259 PIC setup. CPU exceptions use vectors 0-31 and the
+ * two PICs are remapped so IRQ 0-15 arrive on vectors 32-47.
+ *
+ */
+
+#define EXCEPTION_PAGE_FAULT 14
+
+#define IRQ_BASE_VECTOR 32
+#define IRQ_VECTOR(irq) (IRQ_BASE_VECTOR + (irq))
+
+#define IRQ_TIMER    0
+#define IRQ_KEYBOARD 1
+#define IRQ_CASCADE  2
+#define IRQ_COM1     4
+#define IRQ_ATA0     14
+
+//Local APIC vectors: interprocessor interrupts and the spurious vector
+#define IPI_VECTOR      0xF0
+#define SPURIOUS_VECTOR 0xFF
+
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+
+/*
+ * Register state saved by the common interrupt stub, lowest address first
+ *
+ */
+struct interrupt_frame {
+    uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;   // pusha
+    uint32_t vector;
+    uint32_t error_code;
+    uint32_t eip, cs, eflags;                                 // pushed by the CPU
+};
+
+typedef void (*interrupt_handler_t)(struct interrupt_frame *frame);
+
+void interrupts_init(void);
+void interrupts_init_ap(void);
+void register_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
+void unhandled_exception(struct interrupt_frame *frame);
+void pic_unmask_irq(uint8_t irq);
+void pic_mask_irq(uint8_t irq);
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf\n\tpop %0\n\tcli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("push %0\n\tpopf" :: "r"(flags) : "memory", "cc");
+}
+
+static inline void enable_interrupts(void) {
+    __asm__ __volatile__("sti" ::: "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#endif
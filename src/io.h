@@ -0,0 +1,56 @@
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <stdint.h>
+
+/*
+ * x86 port I/O helpers
+ *
+ */
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t rv;
+    __asm__ __volatile__ ("inb %1, %0" : "=a" (rv) : "dN" (port));
+    return rv;
+}
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__ ("outb %0, %1" :: "a" (val), "dN" (port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t rv;
+    __asm__ __volatile__ ("inw %1, %0" : "=a" (rv) : "dN" (port));
+    return rv;
+}
+
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ __volatile__ ("outw %0, %1" :: "a" (val), "dN" (port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t rv;
+    __asm__ __volatile__ ("inl %1, %0" : "=a" (rv) : "dN" (port));
+    return rv;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ __volatile__ ("outl %0, %1" :: "a" (val), "dN" (port));
+}
+
+//read count 16-bit words from port into buf
+static inline void insw(uint16_t port, void *buf, uint32_t count) {
+    __asm__ __volatile__ ("rep insw" : "+D" (buf), "+c" (count) : "d" (port) : "memory");
+}
+
+//write count 16-bit words from buf to port
+static inline void outsw(uint16_t port, const void *buf, uint32_t count) {
+    __asm__ __volatile__ ("rep outsw" : "+S" (buf), "+c" (count) : "d" (port) : "memory");
+}
+
+//short delay by writing to an unused port
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+#endif
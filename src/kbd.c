@@ -0,0 +1,215 @@
+#include "kbd.h"
+#include "interrupt.h"
+#include "io.h"
+#include "thread.h"
+#include <stdint.h>
+
+#define STATUS_OUTPUT_FULL 0x01
+
+#define SC_RELEASE   0x80
+#define SC_EXTENDED  0xE0
+#define SC_PAUSE     0xE1           // followed by five more bytes, no release
+#define SC_LCTRL     0x1D
+#define SC_LSHIFT    0x2A
+#define SC_RSHIFT    0x36
+#define SC_LALT      0x38
+#define SC_CAPS      0x3A
+
+//which modifier keys are down, left and right kept apart so releasing one
+//shift doesn't cancel the other
+#define HELD_LSHIFT 0x01
+#define HELD_RSHIFT 0x02
+#define HELD_LCTRL  0x04
+#define HELD_RCTRL  0x08
+#define HELD_LALT   0x10
+#define HELD_RALT   0x20
+
+//Scancode set 1 to US ASCII, unshifted and shifted
+static const char keymap[0x3A] = {
+    0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
+    0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
+    0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
+    '*', 0, ' ',
+};
+
+static const char keymap_shift[0x3A] = {
+    0, 27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+    0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',
+    0, '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,
+    '*', 0, ' ',
+};
+
+//The IRQ handler is the only writer of ring_head and the reader the only
+//writer of ring_tail. Each side fills or empties a slot before publishing
+//its index, and x86 keeps stores in order, so a compiler barrier is all
+//the ordering needed.
+static uint8_t ring[KBD_RING_SIZE];
+static volatile uint32_t ring_head = 0;
+static volatile uint32_t ring_tail = 0;
+static volatile uint32_t dropped = 0;
+
+static struct wait_queue kbd_waiters;
+
+//translation state, only touched by the reader
+static uint8_t held = 0;
+static uint8_t caps_lock = 0;
+static uint8_t prefix_e0 = 0;
+static uint8_t pause_skip = 0;
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+static int ring_empty(void) {
+    return ring_head == ring_tail;
+}
+
+static void ring_push(uint8_t sc) {
+    uint32_t head = ring_head;
+    if (head - ring_tail == KBD_RING_SIZE) {
+        dropped++;
+        return;
+    }
+    ring[head & (KBD_RING_SIZE - 1)] = sc;
+    barrier();
+    ring_head = head + 1;
+}
+
+static int ring_pop(uint8_t *sc) {
+    uint32_t tail = ring_tail;
+    if (tail == ring_head)
+        return -1;
+    barrier();
+    *sc = ring[tail & (KBD_RING_SIZE - 1)];
+    barrier();
+    ring_tail = tail + 1;
+    return 0;
+}
+
+static void kbd_irq_handler(struct interrupt_frame *frame) {
+    ring_push(inb(KBD_DATA_PORT));
+    thread_wake_all(&kbd_waiters);
+}
+
+void kbd_init(void) {
+    //throw away whatever the controller collected before we listened
+    for (int i = 0; i < KBD_RING_SIZE && (inb(KBD_STATUS_PORT) & STATUS_OUTPUT_FULL); i++)
+        inb(KBD_DATA_PORT);
+
+    register_interrupt_handler(IRQ_VECTOR(IRQ_KEYBOARD), kbd_irq_handler);
+    pic_unmask_irq(IRQ_KEYBOARD);
+}
+
+static uint8_t held_bit(uint8_t code, int extended) {
+    switch (code) {
+    case SC_LSHIFT: return extended ? 0 : HELD_LSHIFT;
+    case SC_RSHIFT: return extended ? 0 : HELD_RSHIFT;
+    case SC_LCTRL:  return extended ? HELD_RCTRL : HELD_LCTRL;
+    case SC_LALT:   return extended ? HELD_RALT : HELD_LALT;
+    }
+    return 0;
+}
+
+//Feed one scancode through the translation state. Returns 0 with ev
+//filled when it completes a key event.
+static int translate(uint8_t sc, struct kbd_event *ev) {
+    if (pause_skip) {
+        pause_skip--;
+        return -1;
+    }
+    if (sc == SC_PAUSE) {
+        pause_skip = 5;
+        return -1;
+    }
+    if (sc == SC_EXTENDED) {
+        prefix_e0 = 1;
+        return -1;
+    }
+    //0x00 and 0xFF are controller errors, 0xFA and 0xFE command replies
+    if (sc == 0x00 || sc == 0xFF || sc == 0xFA || sc == 0xFE) {
+        prefix_e0 = 0;
+        return -1;
+    }
+
+    int extended = prefix_e0;
+    int release = sc & SC_RELEASE;
+    uint8_t code = sc & ~SC_RELEASE;
+    prefix_e0 = 0;
+
+    //print screen and friends send a fake shift around the real key
+    if (extended && (code == SC_LSHIFT || code == SC_RSHIFT))
+        return -1;
+
+    uint8_t bit = held_bit(code, extended);
+    if (bit) {
+        if (release)
+            held &= ~bit;
+        else
+            held |= bit;
+    } else if (code == SC_CAPS && !extended && !release) {
+        caps_lock ^= 1;
+    }
+
+    ev->scancode = code;
+    ev->flags = 0;
+    if (release)
+        ev->flags |= KBD_RELEASE;
+    if (extended)
+        ev->flags |= KBD_EXTENDED;
+    if (held & (HELD_LSHIFT | HELD_RSHIFT))
+        ev->flags |= KBD_SHIFT;
+    if (held & (HELD_LCTRL | HELD_RCTRL))
+        ev->flags |= KBD_CTRL;
+    if (held & (HELD_LALT | HELD_RALT))
+        ev->flags |= KBD_ALT;
+    if (caps_lock)
+        ev->flags |= KBD_CAPS;
+
+    char c = 0;
+    if (extended) {
+        //keypad enter and divide are the only extended keys with a character
+        if (code == 0x1C)
+            c = '\n';
+        else if (code == 0x35)
+            c = '/';
+    } else if (code < sizeof(keymap)) {
+        int shift = (ev->flags & KBD_SHIFT) != 0;
+        c = shift ? keymap_shift[code] : keymap[code];
+        if (caps_lock && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+            c = shift ? keymap[code] : keymap_shift[code];
+    }
+    if (c && (ev->flags & KBD_CTRL) && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+        c &= 0x1F;
+    ev->ascii = c;
+    return 0;
+}
+
+int kbd_read_event(struct kbd_event *ev) {
+    uint8_t sc;
+    while (ring_pop(&sc) == 0) {
+        if (translate(sc, ev) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+//Interrupts are off between the empty check and thread_wait(), so a key
+//arriving in between still wakes us
+int kbd_getc(void) {
+    struct kbd_event ev;
+    for (;;) {
+        uint32_t flags = irq_save();
+        while (ring_empty())
+            thread_wait(&kbd_waiters);
+        irq_restore(flags);
+
+        while (kbd_read_event(&ev) == 0) {
+            if (!(ev.flags & KBD_RELEASE) && ev.ascii)
+                return (unsigned char)ev.ascii;
+        }
+    }
+}
+
+uint32_t kbd_dropped(void) {
+    return dropped;
+}
@@ -0,0 +1,44 @@
+#ifndef __KBD_H__
+#define __KBD_H__
+
+#include <stdint.h>
+
+/*
+ * PS/2 keyboard on IRQ1. The interrupt handler only reads the scancode
+ * and pushes it into a single-producer/single-consumer ring; translation
+ * to key events (scancode set 1, US layout) happens on the reading side.
+ * When the ring is full new scancodes are dropped and counted.
+ *
+ */
+
+#define KBD_DATA_PORT   0x60
+#define KBD_STATUS_PORT 0x64
+
+//power of two, indices run freely and are masked on access
+#define KBD_RING_SIZE 64
+
+//kbd_event.flags
+#define KBD_RELEASE  0x01           // key went up
+#define KBD_EXTENDED 0x02           // came after an 0xE0 prefix
+#define KBD_SHIFT    0x04           // modifier state when the key was seen
+#define KBD_CTRL     0x08
+#define KBD_ALT      0x10
+#define KBD_CAPS     0x20
+
+struct kbd_event {
+    uint8_t scancode;               // without the release bit
+    uint8_t flags;
+    char ascii;                     // 0 for keys without a character
+};
+
+void kbd_init(void);
+
+//kbd_read_event() returns 0 and fills ev if a key event is pending, -1 if
+//not. kbd_getc() blocks until a key with a character is pressed.
+int kbd_read_event(struct kbd_event *ev);
+int kbd_getc(void);
+
+//scancodes lost to a full ring since boot
+uint32_t kbd_dropped(void);
+
+#endif
@@ -2,93 +2,144 @@
 #include <stdint.h>
 #include "rprintf.h"
 #include "page.h"
-#define MULTIBOOT2_HEADER_MAGIC         0xe85250d6
+#include "multiboot.h"
+#include "io.h"
+#include "interrupt.h"
+#include "ata.h"
+#include "fat.h"
+#include "klib.h"
+#include "vga.h"
+#include "log.h"
+#include "serial.h"
+#include "clock.h"
+#include "trace.h"
+#include "thread.h"
+#include "kbd.h"
+#include "smp.h"
 
 const unsigned int multiboot_header[]  __attribute__((section(".multiboot"))) = {MULTIBOOT2_HEADER_MAGIC, 0, 16, -(16+MULTIBOOT2_HEADER_MAGIC), 0, 12};
 
-uint8_t inb (uint16_t _port) {
-    uint8_t rv;
-    __asm__ __volatile__ ("inb %1, %0" : "=a" (rv) : "dN" (_port));
-    return rv;
-}
-
-
-#define SCREEN_WIDTH 80
-#define SCREEN_HEIGHT 25
-
-struct termbuf {
-    char ascii;
-    char color;
-};
-
-void scroll_up(void) {
-    struct termbuf *vram = (struct termbuf*)0xB8000;
-
-    for (int row = 1; row < SCREEN_HEIGHT; row++)
-        for (int col = 0; col < SCREEN_WIDTH; col++)
-            vram[(row-1)*SCREEN_WIDTH + col] = vram[row*SCREEN_WIDTH + col];
-
-    for (int col = 0; col < SCREEN_WIDTH; col++) {
-        vram[(SCREEN_HEIGHT-1)*SCREEN_WIDTH + col].ascii = ' ';
-        vram[(SCREEN_HEIGHT-1)*SCREEN_WIDTH + col].color = 7;
+//Boot stack, placed inside the kernel image so the page frame allocator
+//never hands it out
+#define BOOT_STACK_SIZE 16384
+uint8_t boot_stack[BOOT_STACK_SIZE] __attribute__((section(".stack"), aligned(16)));
+
+//Entry point. GRUB jumps here with the multiboot2 magic in EAX and the
+//physical address of the boot information in EBX.
+__asm__(
+    ".text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    mov $boot_stack + 16384, %esp\n"
+    "    push %ebx\n"
+    "    push %eax\n"
+    "    call main\n"
+    "1:  hlt\n"
+    "    jmp 1b\n");
+
+
+//Print the log in the background every LOG_DRAIN_TICKS
+#define LOG_DRAIN_TICKS (THREAD_HZ / 10)
+
+static void log_thread(void *arg) {
+    for (;;) {
+        log_drain();
+        thread_sleep(LOG_DRAIN_TICKS);
     }
 }
 
-int x = 0;
-int y = 0;
-
-int putc(int c){
-    struct termbuf *vram = (struct termbuf*)0xB8000;
-
-    if (c == '\n'){
-    x = 0;
-    y++;
-    } else if (c == '\r'){
-    x = 0;
-    } else{
-	vram[y*SCREEN_WIDTH + x].ascii = c;
-	vram[y*SCREEN_WIDTH + x].color = 7;
-	x++;
-    }
-    if (x>= SCREEN_WIDTH) {
-	x = 0;
-	y++;
+//Echo typed characters, sleeping until the keyboard interrupt wakes us
+static void kbd_echo_thread(void *arg) {
+    uint32_t reported = 0;
+    for (;;) {
+        int c = kbd_getc();
+        if (kbd_dropped() != reported) {
+            reported = kbd_dropped();
+            log_warn("kbd: %d scancodes dropped\n", reported);
+        }
+        vga_putc(c);
+        vga_flush();
     }
-    if (y >= SCREEN_HEIGHT) {
-        scroll_up();
-        y = SCREEN_HEIGHT - 1;
-    }
-    return c;
 }
 
-//adapter for esp_printf
-int vga_putc(int c) { return putc(c); }
-
+void main(uint32_t magic, struct multiboot_info *mbi) {
+    //calibrate the TSC first so log timestamps and boot spans are in
+    //real time. The log goes to COM1 as well when there is a UART.
+    clock_init();
+    log_init();
+    serial_init();
+    TRACE_BEGIN("boot");
 
-
-void main() {
     for (int i = 1; i <= 30; i++) {
-        esp_printf(putc, "Line %d: Sphinx of black quartz, judge my vow.\r\n", i);
+        esp_sink_printf(vga_sink, NULL, "Line %d: Sphinx of black quartz, judge my vow.\r\n", i);
     }
 
-    esp_printf(putc, "Current execution level: Kernel mode (Ring 0)\r\n");
+    esp_sink_printf(vga_sink, NULL, "Current execution level: Kernel mode (Ring 0)\r\n");
+
 
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC) {
+        esp_sink_printf(vga_sink, NULL, "Bad multiboot2 magic %x\n", magic);
+        mbi = NULL;
+    }
 
-    init_pfa_list();
-    esp_printf(vga_putc, "Page Frame Allocator Initialized!\n");
+    TRACE_BEGIN("init_pfa_list");
+    init_pfa_list(mbi);
+    TRACE_END();
+    log_drain();
+    esp_sink_printf(vga_sink, NULL, "Page Frame Allocator Initialized!\n");
     print_pfa_state();
 
+    //the firmware's processor tables are read through their physical
+    //addresses, so look before paging
+    smp_detect();
+
     //Enable paging
+    TRACE_BEGIN("enable_paging");
     enable_paging();
-    esp_printf(vga_putc, "Paging enabled from kernel_main.\n");
+    TRACE_END();
+    log_drain();
+    esp_sink_printf(vga_sink, NULL, "Paging enabled from kernel_main.\n");
     //Quick confirmation
-    esp_printf(vga_putc, "Hello from paged world!\n");
-
-
-    while(1){
-        uint8_t status = inb(0x60);
-    }
-
-
-
+    esp_sink_printf(vga_sink, NULL, "Hello from paged world!\n");
+    vmm_dump();
+
+    //IDT, PIC and the IRQ14 disk driver
+    TRACE_BEGIN("interrupts_init");
+    interrupts_init();
+    page_fault_init();
+    thread_init();
+    TRACE_END();
+    TRACE_BEGIN("smp_init");
+    smp_init();
+    TRACE_END();
+    TRACE_BEGIN("ata_init");
+    ata_init();
+    TRACE_END();
+    kbd_init();
+    enable_interrupts();
+    esp_sink_printf(vga_sink, NULL, "Interrupts enabled.\n");
+    thread_create("logd", log_thread, NULL);
+    thread_create("kbd", kbd_echo_thread, NULL);
+
+    TRACE_BEGIN("fatInit");
+    fatInit();
+    TRACE_END();
+    TRACE_END();
+    log_drain();
+
+#ifdef CONFIG_BENCHMARKS
+    extern uint32_t g_partition_lba_offset;
+    ata_benchmark(g_partition_lba_offset, 64);
+    klib_benchmark();
+    vga_benchmark();
+    smp_benchmark();
+#endif
+
+#ifdef CONFIG_TRACE
+    esp_sink_printf(vga_sink, NULL, "Boot timing (TSC %d kHz):\n", clock_tsc_khz());
+    trace_dump();
+#endif
+
+    //main is done; the idle thread halts when nothing else runs
+    thread_exit();
 }
@@ -0,0 +1,165 @@
+#include "klib.h"
+#include "interrupt.h"
+#include "kmalloc.h"
+#include "rprintf.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+//Below this the startup cost of the rep string instructions outweighs
+//what they save, so short copies and fills use plain dword moves
+#define KLIB_REP_THRESHOLD 64
+
+//dword loads that may alias any other type
+typedef uint32_t __attribute__((may_alias)) alias_u32;
+
+//Keep gcc from turning the short loops back into calls to these functions
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+NO_LIBCALL void *memcpy(void *dest, const void *src, size_t n) {
+    void *ret = dest;
+    size_t head, words;
+
+    if (n < KLIB_REP_THRESHOLD) {
+        uint8_t *d = (uint8_t *)dest;
+        const uint8_t *s = (const uint8_t *)src;
+        for (; n >= 4; n -= 4, d += 4, s += 4)
+            *(alias_u32 *)d = *(const alias_u32 *)s;
+        while (n--)
+            *d++ = *s++;
+        return ret;
+    }
+
+    //bytes up to a dword aligned destination, dwords, then the tail
+    head = (0u - (uint32_t)dest) & 3;
+    n -= head;
+    words = n >> 2;
+    n &= 3;
+    __asm__ __volatile__("rep movsb" : "+D"(dest), "+S"(src), "+c"(head) :: "memory");
+    __asm__ __volatile__("rep movsl" : "+D"(dest), "+S"(src), "+c"(words) :: "memory");
+    __asm__ __volatile__("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) :: "memory");
+    return ret;
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    //a forward copy is safe unless dest starts inside src
+    if (d <= s || d >= s + n)
+        return memcpy(dest, src, n);
+
+    //copy from the top down with the direction flag set
+    d += n - 1;
+    s += n - 1;
+    __asm__ __volatile__("std\n\trep movsb\n\tcld" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+    return dest;
+}
+
+NO_LIBCALL void *memset(void *s, int c, size_t n) {
+    void *ret = s;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    size_t head, words;
+
+    if (n < KLIB_REP_THRESHOLD) {
+        uint8_t *d = (uint8_t *)s;
+        for (; n >= 4; n -= 4, d += 4)
+            *(alias_u32 *)d = pattern;
+        while (n--)
+            *d++ = (uint8_t)c;
+        return ret;
+    }
+
+    head = (0u - (uint32_t)s) & 3;
+    n -= head;
+    words = n >> 2;
+    n &= 3;
+    __asm__ __volatile__("rep stosb" : "+D"(s), "+c"(head) : "a"(pattern) : "memory");
+    __asm__ __volatile__("rep stosl" : "+D"(s), "+c"(words) : "a"(pattern) : "memory");
+    __asm__ __volatile__("rep stosb" : "+D"(s), "+c"(n) : "a"(pattern) : "memory");
+    return ret;
+}
+
+void *memset32(void *s, uint32_t value, size_t count) {
+    void *ret = s;
+    __asm__ __volatile__("rep stosl" : "+D"(s), "+c"(count) : "a"(value) : "memory");
+    return ret;
+}
+
+//Skip equal dwords, then find the differing byte
+NO_LIBCALL int memcmp(const void *s1, const void *s2, size_t n) {
+    const uint8_t *p1 = (const uint8_t *)s1;
+    const uint8_t *p2 = (const uint8_t *)s2;
+
+    while (n >= 4 && *(const alias_u32 *)p1 == *(const alias_u32 *)p2) {
+        p1 += 4;
+        p2 += 4;
+        n -= 4;
+    }
+    for (; n; n--, p1++, p2++) {
+        if (*p1 != *p2)
+            return *p1 - *p2;
+    }
+    return 0;
+}
+
+//Byte-at-a-time versions, the way the callers used to do it, as the
+//benchmark baseline
+static void byte_copy(uint8_t *d, const uint8_t *s, size_t n) {
+    while (n--)
+        *d++ = *s++;
+}
+
+static void byte_set(uint8_t *d, uint8_t c, size_t n) {
+    while (n--)
+        *d++ = c;
+}
+
+static int byte_cmp(const uint8_t *p1, const uint8_t *p2, size_t n) {
+    for (; n; n--, p1++, p2++)
+        if (*p1 != *p2)
+            return *p1 - *p2;
+    return 0;
+}
+
+#define BENCH_MAX  65536
+#define BENCH_REPS 8
+
+//Average cycles for one call, over BENCH_REPS calls after a warm-up call
+#define BENCH(result, call)                                 \
+    do {                                                    \
+        call;                                               \
+        uint64_t t0 = rdtsc();                              \
+        for (int r = 0; r < BENCH_REPS; r++)                \
+            call;                                           \
+        result = (uint32_t)(rdtsc() - t0) / BENCH_REPS;     \
+    } while (0)
+
+//Cycles per call for the byte loops against the klib routines
+void klib_benchmark(void) {
+    uint8_t *a = kmalloc(BENCH_MAX + 4);
+    uint8_t *b = kmalloc(BENCH_MAX + 4);
+    if (!a || !b) {
+        kfree(a);
+        kfree(b);
+        return;
+    }
+
+    esp_sink_printf(vga_sink, NULL, "klib cycles (byte loop / klib):\n");
+    for (uint32_t size = 16; size <= BENCH_MAX; size *= 4) {
+        uint32_t cpy_b, cpy_k, set_b, set_k, cmp_b, cmp_k;
+
+        BENCH(set_b, byte_set(a, 0x5A, size));
+        BENCH(set_k, memset(a, 0x5A, size));
+        //source one byte off dword alignment to exercise the head fixup
+        BENCH(cpy_b, byte_copy(b, a + 1, size));
+        BENCH(cpy_k, memcpy(b, a + 1, size));
+        BENCH(cmp_b, byte_cmp(a + 1, b, size));
+        BENCH(cmp_k, memcmp(a + 1, b, size));
+
+        esp_sink_printf(vga_sink, NULL, "  %d B: memcpy %d/%d memset %d/%d memcmp %d/%d\n",
+                        size, cpy_b, cpy_k, set_b, set_k, cmp_b, cmp_k);
+    }
+    kfree(a);
+    kfree(b);
+}
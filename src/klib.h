@@ -0,0 +1,27 @@
+#ifndef __KLIB_H__
+#define __KLIB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Freestanding string routines. Short copies and fills use plain dword
+ * moves. Longer ones use rep movsd/stosd once the destination is dword
+ * aligned, with rep movsb/stosb for the odd bytes at either end.
+ *
+ * gcc may emit calls to memcpy/memset/memcmp on its own (struct copies,
+ * large initializers), so these use the standard names.
+ *
+ */
+
+void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+void *memset(void *s, int c, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
+
+//Fill count dwords with value, e.g. VGA cells or page table entries
+void *memset32(void *s, uint32_t value, size_t count);
+
+void klib_benchmark(void);
+
+#endif
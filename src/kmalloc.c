@@ -0,0 +1,290 @@
+#include "kmalloc.h"
+#include "klib.h"
+#include "page.h"
+#include "rprintf.h"
+#include "spinlock.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+//header at the start of every slab. Free objects are chained through
+//their first word.
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *freelist;
+    uint32_t inuse;
+};
+
+//objects start after the header, 16-byte aligned
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15u)
+
+static struct kmem_cache caches[KMALLOC_NUM_CLASSES];
+static int heap_initialized = 0;
+
+//held across every kmalloc and kfree, including the trips to the PFA
+static struct spinlock heap_lock = SPINLOCK_INIT;
+
+//pages the heap currently holds from the page frame allocator
+static uint32_t heap_pages = 0;
+static uint32_t large_allocs = 0;
+static uint32_t large_pages = 0;
+
+static void slab_list_push(struct slab **head, struct slab *s) {
+    s->prev = 0;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_list_remove(struct slab **head, struct slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = 0;
+    s->prev = 0;
+}
+
+static void kmalloc_init(void) {
+    for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        struct kmem_cache *c = &caches[i];
+        c->obj_size = 1u << (KMALLOC_MIN_SHIFT + i);
+
+        //grow the slab until the header and tail waste is at most 1/16
+        c->slab_pages = 1;
+        for (;;) {
+            uint32_t bytes = c->slab_pages * PAGE_SIZE_BYTES;
+            c->objs_per_slab = (bytes - SLAB_HEADER_SIZE) / c->obj_size;
+            if ((bytes - c->objs_per_slab * c->obj_size) * 16 <= bytes || c->slab_pages >= 8)
+                break;
+            c->slab_pages <<= 1;
+        }
+
+        c->partial = 0;
+        c->full = 0;
+        c->empty = 0;
+        c->num_slabs = 0;
+        c->active_objs = 0;
+        c->total_objs = 0;
+        c->total_allocs = 0;
+        c->total_requested = 0;
+    }
+    heap_initialized = 1;
+}
+
+//take npages contiguous frames from the PFA and identity map them
+static struct ppage *heap_get_pages(uint32_t npages) {
+    if ((heap_pages + npages) * PAGE_SIZE_BYTES > CONFIG_HEAP_SIZE)
+        return 0;
+
+    struct ppage *run = allocate_physical_pages(npages);
+    if (!run)
+        return 0;
+
+    if (!map_pages(run->physical_addr, run, pd)) {
+        free_physical_pages(run);
+        return 0;
+    }
+    heap_pages += npages;
+    return run;
+}
+
+static void heap_put_pages(struct ppage *run) {
+    heap_pages -= run->npages;
+    free_physical_pages(run);
+}
+
+static struct slab *slab_create(struct kmem_cache *c) {
+    struct ppage *run = heap_get_pages(c->slab_pages);
+    if (!run)
+        return 0;
+
+    struct slab *s = (struct slab *)run->physical_addr;
+    s->next = 0;
+    s->prev = 0;
+    s->cache = c;
+    s->inuse = 0;
+
+    //every page of the slab points back at it so kfree can find the header
+    for (uint32_t i = 0; i < c->slab_pages; i++)
+        run[i].owner = s;
+
+    //chain the objects into the free list
+    uint8_t *obj = (uint8_t *)s + SLAB_HEADER_SIZE;
+    s->freelist = obj;
+    for (uint32_t i = 0; i < c->objs_per_slab - 1; i++) {
+        *(void **)obj = obj + c->obj_size;
+        obj += c->obj_size;
+    }
+    *(void **)obj = 0;
+
+    c->num_slabs++;
+    c->total_objs += c->objs_per_slab;
+    return s;
+}
+
+static void slab_destroy(struct kmem_cache *c, struct slab *s) {
+    struct ppage *run = phys_to_ppage(s);
+    for (uint32_t i = 0; i < c->slab_pages; i++)
+        run[i].owner = 0;
+
+    c->num_slabs--;
+    c->total_objs -= c->objs_per_slab;
+    heap_put_pages(run);
+}
+
+static void *cache_alloc(struct kmem_cache *c) {
+    struct slab *s = c->partial;
+    if (!s) {
+        if (c->empty) {
+            s = c->empty;
+            c->empty = 0;
+        } else {
+            s = slab_create(c);
+            if (!s)
+                return 0;
+        }
+        slab_list_push(&c->partial, s);
+    }
+
+    void *obj = s->freelist;
+    s->freelist = *(void **)obj;
+    s->inuse++;
+    c->active_objs++;
+
+    if (!s->freelist) {
+        slab_list_remove(&c->partial, s);
+        slab_list_push(&c->full, s);
+    }
+    return obj;
+}
+
+static void cache_free(struct slab *s, void *obj) {
+    struct kmem_cache *c = s->cache;
+
+    if (!s->freelist) {
+        slab_list_remove(&c->full, s);
+        slab_list_push(&c->partial, s);
+    }
+
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    c->active_objs--;
+
+    //keep one empty slab cached, give the rest back to the PFA
+    if (s->inuse == 0) {
+        slab_list_remove(&c->partial, s);
+        if (!c->empty)
+            c->empty = s;
+        else
+            slab_destroy(c, s);
+    }
+}
+
+static void *do_kmalloc(size_t size) {
+    if (!heap_initialized)
+        kmalloc_init();
+
+    if (size > KMALLOC_MAX_SLAB_SIZE) {
+        uint32_t npages = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+        struct ppage *run = heap_get_pages(npages);
+        if (!run)
+            return 0;
+        large_allocs++;
+        large_pages += npages;
+        return run->physical_addr;
+    }
+
+    int cls = 0;
+    while ((1u << (KMALLOC_MIN_SHIFT + cls)) < size)
+        cls++;
+
+    struct kmem_cache *c = &caches[cls];
+    void *obj = cache_alloc(c);
+    if (obj) {
+        c->total_allocs++;
+        c->total_requested += size;
+    }
+    return obj;
+}
+
+void *kmalloc(size_t size) {
+    if (size == 0)
+        return 0;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void *obj = do_kmalloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return obj;
+}
+
+void *kzalloc(size_t size) {
+    void *p = kmalloc(size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+static void do_kfree(void *ptr) {
+    struct ppage *pg = phys_to_ppage(ptr);
+    if (!pg) {
+        esp_sink_printf(vga_sink, NULL, "kfree: bad pointer %x\n", (unsigned)(uintptr_t)ptr);
+        return;
+    }
+
+    if (pg->owner) {
+        cache_free((struct slab *)pg->owner, ptr);
+        return;
+    }
+
+    //large allocation: ptr must be the head of its run
+    if (!pg->npages || pg->physical_addr != ptr) {
+        esp_sink_printf(vga_sink, NULL, "kfree: bad pointer %x\n", (unsigned)(uintptr_t)ptr);
+        return;
+    }
+    large_allocs--;
+    large_pages -= pg->npages;
+    heap_put_pages(pg);
+}
+
+void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    do_kfree(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kmalloc_print_stats(void) {
+    if (!heap_initialized)
+        kmalloc_init();
+
+    esp_sink_printf(vga_sink, NULL, "\nHeap: %d pages in use (limit %d)\n",
+                    heap_pages, CONFIG_HEAP_SIZE / PAGE_SIZE_BYTES);
+    esp_sink_printf(vga_sink, NULL, "  size  slabs  active/total  used(pct)  rounding(pct)\n");
+
+    for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        struct kmem_cache *c = &caches[i];
+        if (!c->num_slabs && !c->total_allocs)
+            continue;
+
+        //share of slab memory held by live objects
+        uint32_t slab_bytes = c->num_slabs * c->slab_pages * PAGE_SIZE_BYTES;
+        uint32_t used = slab_bytes ? (c->active_objs * c->obj_size * 100) / slab_bytes : 0;
+
+        //bytes lost to rounding requests up to the size class
+        uint32_t rounded = c->total_allocs * c->obj_size;
+        uint32_t rounding = rounded ? ((rounded - c->total_requested) * 100) / rounded : 0;
+
+        esp_sink_printf(vga_sink, NULL, "  %4d  %5d  %6d/%6d  %9d  %13d\n",
+                        c->obj_size, c->num_slabs, c->active_objs, c->total_objs, used, rounding);
+    }
+    esp_sink_printf(vga_sink, NULL, "  large: %d allocations, %d pages\n", large_allocs, large_pages);
+}
@@ -0,0 +1,52 @@
+#ifndef __KMALLOC_H__
+#define __KMALLOC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Kernel heap. Requests up to KMALLOC_MAX_SLAB_SIZE bytes are served from
+ * power-of-two size-class slab caches; larger ones get their own run of
+ * physically contiguous pages. All memory comes from
+ * allocate_physical_pages() and is identity mapped in pd.
+ *
+ * CONFIG_HEAP_SIZE caps the number of bytes the heap may take from the
+ * page frame allocator.
+ *
+ */
+
+#ifndef CONFIG_HEAP_SIZE
+#define CONFIG_HEAP_SIZE (16 * 1024 * 1024)
+#endif
+
+#define KMALLOC_MIN_SHIFT     4     // smallest size class is 16 bytes
+#define KMALLOC_NUM_CLASSES   8     // 16 B .. 2 KiB
+#define KMALLOC_MAX_SLAB_SIZE (1u << (KMALLOC_MIN_SHIFT + KMALLOC_NUM_CLASSES - 1))
+
+struct slab;
+
+/*
+ * One cache per size class
+ *
+ */
+struct kmem_cache {
+    uint32_t obj_size;
+    uint32_t slab_pages;        // pages per slab, a power of two
+    uint32_t objs_per_slab;
+    struct slab *partial;       // slabs with free objects
+    struct slab *full;          // slabs with none
+    struct slab *empty;         // one fully free slab kept around
+    uint32_t num_slabs;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    uint32_t total_allocs;      // cumulative, for fragmentation stats
+    uint32_t total_requested;   // bytes asked for across total_allocs
+};
+
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+void kmalloc_print_stats(void);
+
+#endif
@@ -0,0 +1,160 @@
+#include "log.h"
+#include "clock.h"
+#include "klib.h"
+#include "rprintf.h"
+#include "serial.h"
+#include "smp.h"
+#include "vga.h"
+#include <stdarg.h>
+#include <stdint.h>
+
+//records[log_tail % LOG_RECORDS] up to log_head are reserved; the ones
+//with a matching seq are committed and wait to be drained. When the ring is
+//full the new record is dropped, since the drainer may be reading the
+//oldest one. Any CPU, and interrupt handlers, may log.
+static struct log_record records[LOG_RECORDS];
+static volatile uint32_t log_head = 0;
+static volatile uint32_t log_tail = 0;
+static volatile uint32_t log_lost = 0;
+static volatile uint32_t draining = 0;
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+//cmpxchg and xchg are 486 instructions, like the xadd in spinlock.h
+static inline int compare_and_swap(volatile uint32_t *p, uint32_t old, uint32_t new) {
+    uint32_t prev;
+    __asm__ __volatile__("lock cmpxchgl %2, %1"
+                         : "=a"(prev), "+m"(*p) : "r"(new), "0"(old) : "memory");
+    return prev == old;
+}
+
+static inline uint32_t swap(volatile uint32_t *p, uint32_t value) {
+    __asm__ __volatile__("xchgl %0, %1" : "+r"(value), "+m"(*p) :: "memory");
+    return value;
+}
+
+static inline void atomic_inc(volatile uint32_t *p) {
+    __asm__ __volatile__("lock incl %0" : "+m"(*p) :: "memory");
+}
+
+static int level_limit = CONFIG_LOG_LEVEL;
+static int console_level = LOG_INFO;
+
+static const char level_tag[] = "?EWID";
+
+void log_init(void) {
+    memset(records, 0, sizeof(records));
+    log_head = 0;
+    log_tail = 0;
+    log_lost = 0;
+}
+
+void log_set_level(int level) {
+    level_limit = level;
+}
+
+void log_set_console_level(int level) {
+    console_level = level;
+}
+
+uint32_t log_dropped(void) {
+    return log_lost;
+}
+
+//Reserve the slot at the head, or return -1 when the ring is full
+static int log_reserve(uint32_t *pos) {
+    uint32_t head;
+    do {
+        head = log_head;
+        if (head - log_tail >= LOG_RECORDS)
+            return -1;
+    } while (!compare_and_swap(&log_head, head, head + 1));
+    *pos = head;
+    return 0;
+}
+
+//The message is formatted on the stack and copied into a reserved slot;
+//storing seq last commits it, and x86 keeps stores in order so the drainer
+//never sees a committed slot with old contents
+static void vklog(int level, const char *fmt, va_list ap) {
+    char line[LOG_LINE_MAX + 1];
+    uint32_t pos;
+
+    if (level > level_limit)
+        return;
+
+    int len = esp_vsnprintf(line, sizeof(line), fmt, ap);
+    if (len > LOG_LINE_MAX) {
+        //a cut off line still ends the line
+        len = LOG_LINE_MAX;
+        line[LOG_LINE_MAX - 1] = '\n';
+    }
+
+    if (log_reserve(&pos) < 0) {
+        atomic_inc(&log_lost);
+        return;
+    }
+
+    struct log_record *rec = &records[pos % LOG_RECORDS];
+    rec->stamp = clock_now_us();
+    rec->level = level;
+    rec->len = len;
+    memcpy(rec->text, line, len);
+    barrier();
+    rec->seq = pos + 1;
+
+    if (level <= LOG_ERR)
+        log_drain();
+}
+
+void klog(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vklog(level, fmt, ap);
+    va_end(ap);
+}
+
+void printk(charptr ctrl, ...) {
+    va_list ap;
+    va_start(ap, ctrl);
+    vklog(LOG_INFO, ctrl, ap);
+    va_end(ap);
+}
+
+//Print waiting records: all of them on the serial port with timestamp and
+//level, the ones at or below the console level on the screen as is
+void log_drain(void) {
+    struct log_record rec;
+
+    //the console belongs to the bootstrap processor; records logged on
+    //other CPUs wait for the next drain there
+    if (smp_cpu_index() != 0)
+        return;
+
+    //one drainer at a time; whoever finds it busy leaves the records to it
+    if (swap(&draining, 1))
+        return;
+
+    for (;;) {
+        uint32_t tail = log_tail;
+        struct log_record *slot = &records[tail % LOG_RECORDS];
+        if (tail == log_head || slot->seq != tail + 1)
+            break;
+        barrier();
+        rec = *slot;
+        barrier();
+        log_tail = tail + 1;
+
+        if (serial_present()) {
+            char prefix[16];
+            int n = esp_snprintf(prefix, sizeof(prefix), "[%8d] %c ", rec.stamp,
+                                 level_tag[rec.level <= LOG_DEBUG ? rec.level : 0]);
+            serial_write(prefix, n < (int)sizeof(prefix) ? n : (int)sizeof(prefix) - 1);
+            serial_write(rec.text, rec.len);
+        }
+        if (rec.level <= console_level)
+            vga_write(rec.text, rec.len);
+    }
+    barrier();
+    draining = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+/*
+ * Kernel log. klog() formats a message into a ring of records with a
+ * level and a timestamp and returns; nothing is printed until log_drain(),
+ * which sends every record to the serial port and the ones at or below the
+ * console level to the screen. Errors logged on the bootstrap processor
+ * are drained right away; log_drain() does nothing on other CPUs.
+ *
+ * The ring takes no lock. A writer reserves a slot by moving the head with
+ * lock cmpxchg, fills it and then commits it by storing its sequence
+ * number; the drainer stops at the first slot that isn't committed yet.
+ *
+ * Messages above CONFIG_LOG_LEVEL are compiled out of the log_* macros;
+ * log_set_level() filters further at run time.
+ *
+ */
+
+#define LOG_ERR   1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+
+#ifndef CONFIG_LOG_LEVEL
+#define CONFIG_LOG_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RECORDS  128
+#define LOG_LINE_MAX 116
+
+struct log_record {
+    volatile uint32_t seq;          // position in the ring + 1 once committed
+    uint32_t stamp;                 // microseconds since clock_init
+    uint8_t level;
+    uint8_t len;
+    char text[LOG_LINE_MAX];
+};
+
+void log_init(void);
+void klog(int level, const char *fmt, ...);
+void log_drain(void);
+
+//records above level are dropped; records above console level only go
+//to the serial port
+void log_set_level(int level);
+void log_set_console_level(int level);
+uint32_t log_dropped(void);
+
+#define log_err(...)  klog(LOG_ERR, __VA_ARGS__)
+
+#if CONFIG_LOG_LEVEL >= LOG_WARN
+#define log_warn(...) klog(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) do { } while (0)
+#endif
+
+#if CONFIG_LOG_LEVEL >= LOG_INFO
+#define log_info(...) klog(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) do { } while (0)
+#endif
+
+#if CONFIG_LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) klog(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) do { } while (0)
+#endif
+
+#endif
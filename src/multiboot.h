@@ -0,0 +1,77 @@
+#ifndef __MULTIBOOT_H__
+#define __MULTIBOOT_H__
+
+#include <stdint.h>
+
+/*
+ * Multiboot2 boot information structures. GRUB leaves the magic number in
+ * EAX and the physical address of the info structure in EBX when it jumps
+ * to the kernel entry point.
+ *
+ */
+
+#define MULTIBOOT2_HEADER_MAGIC         0xe85250d6
+#define MULTIBOOT2_BOOTLOADER_MAGIC     0x36d76289
+
+#define MULTIBOOT_TAG_TYPE_END           0
+#define MULTIBOOT_TAG_TYPE_CMDLINE       1
+#define MULTIBOOT_TAG_TYPE_MODULE        3
+#define MULTIBOOT_TAG_TYPE_BASIC_MEMINFO 4
+#define MULTIBOOT_TAG_TYPE_MMAP          6
+
+#define MULTIBOOT_MEMORY_AVAILABLE       1
+
+/*
+ * Fixed part of the info structure. Tags follow it, each starting on an
+ * 8-byte boundary, until a tag of type MULTIBOOT_TAG_TYPE_END.
+ *
+ */
+struct multiboot_info {
+    uint32_t total_size;
+    uint32_t reserved;
+};
+
+struct multiboot_tag {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct multiboot_tag_basic_meminfo {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mem_lower;     // KiB of memory below 1 MiB
+    uint32_t mem_upper;     // KiB of memory above 1 MiB
+};
+
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+} __attribute__((packed));
+
+struct multiboot_tag_mmap {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot_mmap_entry entries[];
+};
+
+struct multiboot_tag_module {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];
+};
+
+static inline struct multiboot_tag *multiboot_first_tag(const struct multiboot_info *mbi) {
+    return (struct multiboot_tag *)((uint8_t *)mbi + 8);
+}
+
+static inline struct multiboot_tag *multiboot_next_tag(const struct multiboot_tag *tag) {
+    return (struct multiboot_tag *)((uint8_t *)tag + ((tag->size + 7) & ~7u));
+}
+
+#endif
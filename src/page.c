@@ -1,216 +1,1022 @@
 #include "page.h"
+#include "interrupt.h"
+#include "klib.h"
+#include "log.h"
+#include "multiboot.h"
 #include "rprintf.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "vga.h"
 #include <stdint.h>
 #include <stddef.h>
 
-//array representing all pages
-static struct ppage physical_page_array[NUM_PHYSICAL_PAGES];
+//array representing all pages, indexed by frame number. It is carved out of
+//usable RAM at boot and sized from the multiboot2 memory map.
+static struct ppage *physical_page_array = 0;
+static uint32_t pfa_nframes = 0;
 
-//head of the free list
-struct ppage *free_page_list = 0;
+//physical range holding physical_page_array
+static uint32_t pfa_meta_start = 0;
+static uint32_t pfa_meta_end = 0;
 
-void init_pfa_list(void) {
-    //initialize all pages and link them together
-    for (int i = 0; i < NUM_PHYSICAL_PAGES; i++) {
-        physical_page_array[i].physical_addr = (void *)((uintptr_t)i * PAGE_SIZE_BYTES);
-        physical_page_array[i].next = (i < NUM_PHYSICAL_PAGES - 1) ? &physical_page_array[i + 1] : 0;
-        physical_page_array[i].prev = (i > 0) ? &physical_page_array[i - 1] : 0;
-    }
-    free_page_list = &physical_page_array[0];
+//free_area[k] is the list of free blocks of 2^k contiguous pages
+static struct ppage *free_area[PFA_MAX_ORDER];
+static unsigned int free_blocks[PFA_MAX_ORDER];
+
+//guards the free lists and the frame descriptors' allocation fields
+static struct spinlock pfa_lock = SPINLOCK_INIT;
+
+static inline unsigned int page_index(const struct ppage *p) {
+    return (unsigned int)(p - physical_page_array);
 }
 
-//allocate npages from the front of the free list
-struct ppage *allocate_physical_pages(unsigned int npages) {
-    if (!free_page_list || npages == 0)
-        return 0;
+static void free_area_push(struct ppage *blk, unsigned int order) {
+    blk->order = order;
+    blk->is_free = 1;
+    blk->prev = 0;
+    blk->next = free_area[order];
+    if (free_area[order])
+        free_area[order]->prev = blk;
+    free_area[order] = blk;
+    free_blocks[order]++;
+}
+
+static void free_area_remove(struct ppage *blk) {
+    if (blk->prev)
+        blk->prev->next = blk->next;
+    else
+        free_area[blk->order] = blk->next;
+    if (blk->next)
+        blk->next->prev = blk->prev;
 
-    //check if there's enough free pages
-    unsigned int count = 0;
-    struct ppage *cur = free_page_list;
-    while (cur && count < npages) {
-        count++;
-        cur = cur->next;
+    free_blocks[blk->order]--;
+    blk->next = 0;
+    blk->prev = 0;
+    blk->is_free = 0;
+}
+
+//free one aligned 2^order block, merging with its buddy for as long as
+//the buddy is a free block of the same order
+static void buddy_free_block(unsigned int idx, unsigned int order) {
+    while (order < PFA_MAX_ORDER - 1) {
+        unsigned int buddy = idx ^ (1u << order);
+        if (buddy + (1u << order) > pfa_nframes)
+            break;
+
+        struct ppage *b = &physical_page_array[buddy];
+        if (!b->is_free || b->order != order)
+            break;
+
+        free_area_remove(b);
+        idx &= ~(1u << order);
+        order++;
     }
-    if (count < npages)
-        //return 0 if there's not enough pages
-        return 0; 
+    free_area_push(&physical_page_array[idx], order);
+}
+
+//free pages [idx, idx + n) as the largest naturally aligned blocks that fit
+static void buddy_free_range(unsigned int idx, unsigned int n) {
+    while (n) {
+        unsigned int order = 0;
+        while (order + 1 < PFA_MAX_ORDER &&
+               (idx & ((2u << order) - 1)) == 0 &&
+               (2u << order) <= n)
+            order++;
 
-    //detach npages from the free list
-    struct ppage *alloc_head = free_page_list;
-    struct ppage *alloc_tail = alloc_head;
-    for (unsigned int i = 1; i < npages; i++) {
-        alloc_tail = alloc_tail->next;
+        buddy_free_block(idx, order);
+        idx += 1u << order;
+        n -= 1u << order;
     }
+}
 
-    free_page_list = alloc_tail->next;
-    if (free_page_list)
-        free_page_list->prev = 0;
+//physical ranges that must never be handed out (kernel, multiboot data)
+struct phys_range {
+    uint32_t start;
+    uint32_t end;
+};
 
-    alloc_tail->next = 0;
-    alloc_head->prev = 0;
+#define PFA_MAX_RESERVED 16
+static struct phys_range reserved[PFA_MAX_RESERVED];
+static int num_reserved = 0;
 
-    return alloc_head;
+static void reserve_range(uint32_t start, uint32_t end) {
+    if (num_reserved >= PFA_MAX_RESERVED || end <= start)
+        return;
+    reserved[num_reserved].start = start & ~(PAGE_SIZE_BYTES - 1);
+    reserved[num_reserved].end = (end + PAGE_SIZE_BYTES - 1) & ~(PAGE_SIZE_BYTES - 1);
+    num_reserved++;
 }
 
-//return a list of pages to the free list
-void free_physical_pages(struct ppage *ppage_list) {
-    if (!ppage_list)
+//returns the end of the reserved range containing addr, or 0 if none
+static uint32_t reserved_end(uint32_t addr) {
+    for (int i = 0; i < num_reserved; i++)
+        if (addr >= reserved[i].start && addr < reserved[i].end)
+            return reserved[i].end;
+    return 0;
+}
+
+//usable RAM regions, clipped to [PFA_LOW_LIMIT, 4 GiB) and page aligned
+#define PFA_LOW_LIMIT 0x100000
+#define PFA_MAX_REGIONS 32
+static struct phys_range usable[PFA_MAX_REGIONS];
+static int num_usable = 0;
+
+static void add_usable(uint64_t addr, uint64_t len) {
+    uint64_t end = addr + len;
+    if (end > 0xFFFFF000ull)
+        end = 0xFFFFF000ull;
+    if (addr < PFA_LOW_LIMIT)
+        addr = PFA_LOW_LIMIT;
+    addr = (addr + PAGE_SIZE_BYTES - 1) & ~(uint64_t)(PAGE_SIZE_BYTES - 1);
+    end &= ~(uint64_t)(PAGE_SIZE_BYTES - 1);
+    if (end <= addr || num_usable >= PFA_MAX_REGIONS)
         return;
+    usable[num_usable].start = (uint32_t)addr;
+    usable[num_usable].end = (uint32_t)end;
+    num_usable++;
+}
+
+//find a page-aligned spot for nbytes at or above from that lies inside a
+//usable region and does not overlap any reserved range
+static uint32_t place_metadata(uint32_t from, uint32_t nbytes) {
+    for (int r = 0; r < num_usable; r++) {
+        uint32_t start = usable[r].start > from ? usable[r].start : from;
+        while (start < usable[r].end && usable[r].end - start >= nbytes) {
+            uint32_t end = start + nbytes;
+            uint32_t bump = 0;
+            for (int i = 0; i < num_reserved; i++)
+                if (start < reserved[i].end && end > reserved[i].start)
+                    bump = reserved[i].end;
+            if (!bump)
+                return start;
+            start = bump;
+        }
+    }
+    return 0;
+}
+
+void init_pfa_list(const struct multiboot_info *mbi) {
+    extern char _end_kernel;
+
+    for (int i = 0; i < PFA_MAX_ORDER; i++) {
+        free_area[i] = 0;
+        free_blocks[i] = 0;
+    }
+    num_reserved = 0;
+    num_usable = 0;
+    pfa_nframes = 0;
+
+    if (!mbi) {
+        log_err("PFA: no multiboot info, no memory to manage\n");
+        return;
+    }
+
+    //kernel image, the multiboot info itself and any boot modules
+    reserve_range(0x100000, (uint32_t)&_end_kernel);
+    reserve_range((uint32_t)mbi, (uint32_t)mbi + mbi->total_size);
+
+    struct multiboot_tag_basic_meminfo *meminfo = 0;
+    struct multiboot_tag_mmap *mmap = 0;
+    for (struct multiboot_tag *tag = multiboot_first_tag(mbi);
+         tag->type != MULTIBOOT_TAG_TYPE_END; tag = multiboot_next_tag(tag)) {
+        if (tag->type == MULTIBOOT_TAG_TYPE_MODULE) {
+            struct multiboot_tag_module *mod = (struct multiboot_tag_module *)tag;
+            reserve_range(mod->mod_start, mod->mod_end);
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_BASIC_MEMINFO) {
+            meminfo = (struct multiboot_tag_basic_meminfo *)tag;
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+            mmap = (struct multiboot_tag_mmap *)tag;
+        }
+    }
+
+    //collect usable RAM, falling back to the basic meminfo tag
+    if (mmap) {
+        uint8_t *entry = (uint8_t *)mmap->entries;
+        uint8_t *mmap_end = (uint8_t *)mmap + mmap->size;
+        for (; entry < mmap_end; entry += mmap->entry_size) {
+            struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)entry;
+            if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+                add_usable(e->addr, e->len);
+        }
+    } else if (meminfo) {
+        add_usable(0x100000, (uint64_t)meminfo->mem_upper * 1024);
+    }
+
+    uint32_t top = 0;
+    for (int r = 0; r < num_usable; r++)
+        if (usable[r].end > top)
+            top = usable[r].end;
+    if (!top) {
+        log_err("PFA: no usable memory above 1 MiB\n");
+        return;
+    }
+
+    //the descriptor array covers every frame from 0 to the top of RAM so a
+    //frame number is also its index. Holes simply never become free.
+    uint32_t nframes = top / PAGE_SIZE_BYTES;
+    uint32_t meta_bytes = nframes * sizeof(struct ppage);
+    meta_bytes = (meta_bytes + PAGE_SIZE_BYTES - 1) & ~(PAGE_SIZE_BYTES - 1);
+
+    uint32_t meta = place_metadata((uint32_t)&_end_kernel, meta_bytes);
+    if (!meta) {
+        log_err("PFA: no room for %d frame descriptors\n", nframes);
+        return;
+    }
+    reserve_range(meta, meta + meta_bytes);
+    pfa_meta_start = meta;
+    pfa_meta_end = meta + meta_bytes;
+
+    physical_page_array = (struct ppage *)meta;
+    pfa_nframes = nframes;
+    memset(physical_page_array, 0, nframes * sizeof(struct ppage));
+    for (uint32_t i = 0; i < nframes; i++)
+        physical_page_array[i].physical_addr = (void *)(i * PAGE_SIZE_BYTES);
+
+    //hand each usable run of frames outside the reserved ranges to the
+    //buddy lists as maximal blocks
+    for (int r = 0; r < num_usable; r++) {
+        uint32_t addr = usable[r].start;
+        while (addr < usable[r].end) {
+            uint32_t skip = reserved_end(addr);
+            if (skip) {
+                addr = skip;
+                continue;
+            }
+            uint32_t run_end = addr;
+            while (run_end < usable[r].end && !reserved_end(run_end))
+                run_end += PAGE_SIZE_BYTES;
+            buddy_free_range(addr / PAGE_SIZE_BYTES, (run_end - addr) / PAGE_SIZE_BYTES);
+            addr = run_end;
+        }
+    }
+
+    log_info("PFA: %d usable regions, top of RAM 0x%08x, descriptors at 0x%08x-0x%08x\n",
+             num_usable, top, pfa_meta_start, pfa_meta_end);
+}
+
+//allocate npages physically contiguous frames. The smallest free block of
+//2^order >= npages is split down and its unused tail is given back, so the
+//cost is O(log n) regardless of how many frames are free.
+static struct ppage *do_allocate(unsigned int npages) {
+    unsigned int order = 0;
+    while ((1u << order) < npages)
+        order++;
 
-    //find the end of the list being freed
-    struct ppage *tail = ppage_list;
-    while (tail->next)
-        tail = tail->next;
+    //find the smallest free block that is big enough
+    unsigned int k = order;
+    while (k < PFA_MAX_ORDER && !free_area[k])
+        k++;
+    if (k == PFA_MAX_ORDER)
+        //return 0 if there's no block large enough
+        return 0;
+
+    struct ppage *blk = free_area[k];
+    free_area_remove(blk);
+    unsigned int idx = page_index(blk);
+
+    //split, putting the upper halves back on the lower free lists
+    while (k > order) {
+        k--;
+        free_area_push(&physical_page_array[idx + (1u << k)], k);
+    }
+
+    //give back the tail of the block we don't need
+    if (npages < (1u << order))
+        buddy_free_range(idx + npages, (1u << order) - npages);
+
+    blk->npages = npages;
+    blk->order = order;
+    return blk;
+}
 
-    //attach the free list to the tail
-    if (free_page_list)
-        free_page_list->prev = tail;
+struct ppage *allocate_physical_pages(unsigned int npages) {
+    if (npages == 0 || npages > (1u << (PFA_MAX_ORDER - 1)))
+        return 0;
 
-    tail->next = free_page_list;
-    ppage_list->prev = 0;
-    free_page_list = ppage_list;
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    struct ppage *blk = do_allocate(npages);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+    return blk;
+}
+
+//return a list of page runs to the buddy lists
+void free_physical_pages(struct ppage *ppage_list) {
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    struct ppage *cur = ppage_list;
+    while (cur) {
+        struct ppage *next = cur->next;
+        unsigned int n = cur->npages ? cur->npages : 1;
+
+        cur->next = 0;
+        cur->prev = 0;
+        cur->npages = 0;
+        cur->owner = 0;
+        buddy_free_range(page_index(cur), n);
+        cur = next;
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+//descriptor of the frame containing addr, or 0 if it isn't managed
+struct ppage *phys_to_ppage(void *addr) {
+    uint32_t pfn = (uint32_t)addr / PAGE_SIZE_BYTES;
+    if (pfn >= pfa_nframes)
+        return 0;
+    return &physical_page_array[pfn];
 }
 
 //print helper
-extern int vga_putc(int c);
 #define HEXPTR(x) ((unsigned)((uintptr_t)(x)))
 
 void print_pfa_state(void) {
-    struct ppage *cur = free_page_list;
-    esp_printf(vga_putc, "\nFree list:\n");
-    while (cur) {
-        esp_printf(vga_putc, "  Page @ 0x%08x -> phys=0x%08x\n",
-                   HEXPTR(cur), HEXPTR(cur->physical_addr));
-        cur = cur->next;
+    unsigned int total = 0;
+    esp_sink_printf(vga_sink, NULL, "\nFree blocks by order:\n");
+    for (int k = 0; k < PFA_MAX_ORDER; k++) {
+        if (!free_blocks[k])
+            continue;
+        esp_sink_printf(vga_sink, NULL, "  order %d (%d pages): %d blocks, first phys=0x%08x\n",
+                        k, 1 << k, free_blocks[k], HEXPTR(free_area[k]->physical_addr));
+        total += free_blocks[k] << k;
     }
-    esp_printf(vga_putc, "(end of free list)\n");
+    esp_sink_printf(vga_sink, NULL, "(%d free pages)\n", total);
 }
 
 //Paging
 
 struct page_directory_entry pd[1024] __attribute__((aligned(4096)));
 
-//Pool of 4 KiB-aligned page tables. Allocate per PD slot when necessary
-static struct page pt_pool[16][1024] __attribute__((aligned(4096)));
-static int next_free_pt = 0;
+//Set once CR0.PG is on; from then on changed entries need invlpg
+static int paging_enabled = 0;
 
 static inline uint32_t pd_index(uint32_t va) { return (va >> 22) & 0x3FF; }
 static inline uint32_t pt_index(uint32_t va) { return (va >> 12) & 0x3FF; }
 
-//Map a linked list of physical pages to virtual address
-void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_root) {
-    struct ppage *current_page = pglist;
-    uint32_t virt_addr = (uint32_t)vaddr;
+//Directory and table entries are written as whole 32-bit words
+static inline uint32_t *pde_word(struct page_directory_entry *pd_root, uint32_t va) {
+    return (uint32_t *)&pd_root[pd_index(va)];
+}
+
+static inline void invlpg(uint32_t va) {
+    __asm__ __volatile__("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+//All CPUs share the page tables. vmm_lock covers every change to them;
+//entries changed under it are flushed here at once and on the other CPUs
+//when the lock is dropped.
+static struct spinlock vmm_lock = SPINLOCK_INIT;
+static int tlb_stale = 0;
+
+//Tables emptied under vmm_lock. Another CPU may still walk one through a
+//stale TLB entry, so they only go back to the PFA after the shootdown.
+static struct ppage *pt_freed = NULL;
+
+static inline void flush_page(uint32_t va) {
+    invlpg(va);
+    tlb_stale = 1;
+}
+
+static inline uint32_t vmm_lock_take(void) {
+    return spin_lock_irqsave(&vmm_lock);
+}
+
+static void vmm_lock_drop(uint32_t flags) {
+    int stale = tlb_stale;
+    struct ppage *freed = pt_freed;
+    tlb_stale = 0;
+    pt_freed = NULL;
+    spin_unlock_irqrestore(&vmm_lock, flags);
+    if (stale)
+        smp_tlb_shootdown();
+    if (freed)
+        free_physical_pages(freed);
+}
+
+//Page tables are frames from the PFA, which are not mapped anywhere once
+//paging is on. Before that they are used through their physical address;
+//after, through the recursive PD slot, which makes the table of PD slot i
+//visible at PT_WINDOW + i * 4096.
+static inline uint32_t *pt_of(struct page_directory_entry *pd_root, uint32_t pdi) {
+    if (paging_enabled && pd_root == pd)
+        return (uint32_t *)(PT_WINDOW + (pdi << 12));
+    return (uint32_t *)(((uint32_t *)pd_root)[pdi] & PTE_FRAME_MASK);
+}
+
+//Map one frame at KMAP_TEMP so a table can be filled before it is
+//installed. Not reentrant; callers unmap before returning.
+static void *temp_map(uint32_t phys) {
+    if (!paging_enabled)
+        return (void *)phys;
+
+    uint32_t *pt = pt_of(pd, pd_index(KMAP_TEMP));
+    pt[pt_index(KMAP_TEMP)] = phys | PTE_PRESENT | PTE_RW;
+    invlpg(KMAP_TEMP);
+    return (void *)KMAP_TEMP;
+}
+
+static void temp_unmap(void) {
+    if (!paging_enabled)
+        return;
+
+    uint32_t *pt = pt_of(pd, pd_index(KMAP_TEMP));
+    pt[pt_index(KMAP_TEMP)] = 0;
+    invlpg(KMAP_TEMP);
+}
+
+//Frames set aside by map_range and reserve_pages for the tables they
+//will create, so they can't run out halfway through
+static struct ppage *pt_stash = NULL;
+
+static void unstash_tables(void) {
+    free_physical_pages(pt_stash);
+    pt_stash = NULL;
+}
+
+static int stash_tables(int n) {
+    while (n-- > 0) {
+        struct ppage *pg = allocate_physical_pages(1);
+        if (!pg) {
+            unstash_tables();
+            return MAP_ENOMEM;
+        }
+        pg->next = pt_stash;
+        pt_stash = pg;
+    }
+    return MAP_OK;
+}
+
+//Put a new table in PD slot pdi. Its entries map consecutive frames from
+//first on, or are all clear when first is 0.
+static uint32_t *install_pt(struct page_directory_entry *pd_root, uint32_t pdi,
+                            uint32_t first, uint32_t pde_flags) {
+    struct ppage *pg = pt_stash;
+    if (pg)
+        pt_stash = pg->next;
+    else
+        pg = allocate_physical_pages(1);
+    if (!pg)
+        return NULL;
+    pg->next = NULL;
+
+    uint32_t phys = (uint32_t)pg->physical_addr;
+    uint32_t *pt = temp_map(phys);
+    if (first) {
+        for (int i = 0; i < 1024; i++, first += PAGE_SIZE_BYTES)
+            pt[i] = first;
+    } else {
+        memset(pt, 0, PAGE_SIZE_BYTES);
+    }
+    temp_unmap();
+
+    ((uint32_t *)pd_root)[pdi] = phys | pde_flags;
+    if (paging_enabled && pd_root == pd)
+        flush_page(PT_WINDOW + (pdi << 12));
+    return pt_of(pd_root, pdi);
+}
 
-    while (current_page != NULL) {
-        uint32_t pdi = pd_index(virt_addr);
-        uint32_t pti = pt_index(virt_addr);
+//Take an all-clear table out of the PD; vmm_lock_drop() gives it back to
+//the PFA
+static void free_pt(struct page_directory_entry *pd_root, uint32_t pdi) {
+    uint32_t *pde = &((uint32_t *)pd_root)[pdi];
+    struct ppage *pg = phys_to_ppage((void *)(*pde & PTE_FRAME_MASK));
 
-        //Allocate a fresh Page Table for this PDE if missing
-        if (!pd_root[pdi].present) {
-            if (next_free_pt >= (int)(sizeof(pt_pool) / sizeof(pt_pool[0]))) {
-                //Out of PTs. Stop early
-                break;
+    *pde = 0;
+    if (paging_enabled && pd_root == pd)
+        flush_page(PT_WINDOW + (pdi << 12));
+    pg->next = pt_freed;
+    pt_freed = pg;
+}
+
+static int pt_empty(const uint32_t *pt) {
+    for (int i = 0; i < 1024; i++)
+        if (pt[i])
+            return 0;
+    return 1;
+}
+
+//CPUID.1:EDX.PSE, on CPUs that have CPUID at all (EFLAGS.ID toggles)
+static int cpu_has_pse(void) {
+    static int pse = -1;
+    if (pse < 0) {
+        uint32_t before, after, a, b, c, d;
+        __asm__ __volatile__(
+            "pushf\n\tpop %0\n\t"
+            "mov %0, %1\n\txor $0x200000, %1\n\t"
+            "push %1\n\tpopf\n\t"
+            "pushf\n\tpop %1\n\t"
+            "push %0\n\tpopf"
+            : "=&r"(before), "=&r"(after) :: "cc");
+        pse = 0;
+        if ((before ^ after) & 0x200000) {
+            __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1));
+            pse = (d >> 3) & 1;
+        }
+    }
+    return pse;
+}
+
+//Return the page table covering va, allocating it if create is set. A
+//4 MiB page there is split into a table mapping the same frames. NULL if
+//there is no table (or no frame for one).
+static uint32_t *get_pt(struct page_directory_entry *pd_root, uint32_t va, int create) {
+    uint32_t *pde = pde_word(pd_root, va);
+    uint32_t pdi = pd_index(va);
+
+    if (!(*pde & PTE_PRESENT)) {
+        if (!create)
+            return NULL;
+        return install_pt(pd_root, pdi, 0, PTE_PRESENT | PTE_RW);
+    }
+    if (*pde & PDE_LARGE) {
+        uint32_t first = (*pde & PTE_FRAME_MASK) | (*pde & (PTE_RW | PTE_USER | PTE_PWT | PTE_PCD)) | PTE_PRESENT;
+        uint32_t *pt = install_pt(pd_root, pdi, first, PTE_PRESENT | PTE_RW | (*pde & PTE_USER));
+        //same translations as before, but drop the 4 MiB TLB entry
+        if (pt && paging_enabled)
+            flush_page(pdi << 22);
+        return pt;
+    }
+    return pt_of(pd_root, pdi);
+}
+
+//How the next chunk of a mapping is done: a whole 4 MiB PDE, nothing at
+//all because a 4 MiB page already maps it the same way, or PTEs
+#define CHUNK_PTES  0
+#define CHUNK_LARGE 1
+#define CHUNK_KEEP  2
+
+static int chunk_kind(uint32_t pde, uint32_t va, uint32_t pa, uint32_t npages, uint32_t flags) {
+    uint32_t offset = va & (LARGE_PAGE_SIZE - 1);
+
+    if ((pde & (PTE_PRESENT | PDE_LARGE)) == (PTE_PRESENT | PDE_LARGE) &&
+        (pde & PTE_FRAME_MASK) + offset == pa &&
+        (pde & (PTE_RW | PTE_USER)) == (flags & (PTE_RW | PTE_USER)))
+        return CHUNK_KEEP;
+    if ((flags & PDE_LARGE) && cpu_has_pse() && offset == 0 && npages >= 1024 &&
+        !(pa & (LARGE_PAGE_SIZE - 1)) && (!(pde & PTE_PRESENT) || (pde & PDE_LARGE)))
+        return CHUNK_LARGE;
+    return CHUNK_PTES;
+}
+
+//Page tables map_range would have to create for [va, va + npages)
+static int tables_needed(struct page_directory_entry *pd_root, uint32_t va, uint32_t pa,
+                         uint32_t npages, uint32_t flags) {
+    int needed = 0;
+
+    while (npages) {
+        uint32_t pde = *pde_word(pd_root, va);
+        uint32_t n = 1024 - pt_index(va);
+        if (n > npages)
+            n = npages;
+        if (chunk_kind(pde, va, pa, npages, flags) == CHUNK_PTES &&
+            (!(pde & PTE_PRESENT) || (pde & PDE_LARGE)))
+            needed++;
+        va += n * PAGE_SIZE_BYTES;
+        pa += n * PAGE_SIZE_BYTES;
+        npages -= n;
+    }
+    return needed;
+}
+
+static int check_range(uint32_t vaddr, uint32_t npages) {
+    if (vaddr & (PAGE_SIZE_BYTES - 1) || npages == 0)
+        return MAP_EINVAL;
+    if (vaddr >= VMM_TOP || npages > (VMM_TOP - vaddr) >> 12)
+        return MAP_EINVAL;          //runs into the temp and page table windows
+    return MAP_OK;
+}
+
+//set by the CPU in entries it has used
+#define PTE_USED_BITS (PTE_ACCESSED | PTE_DIRTY)
+
+//Map npages contiguous frames from paddr at vaddr. Each page table is
+//filled in one pass of up to 1024 entries. With PDE_LARGE in flags, every
+//4 MiB aligned stretch becomes a single PDE and only the unaligned edges
+//use page tables. Either the whole range is mapped or, if page tables
+//would run out, nothing is.
+static int do_map_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t paddr,
+                        uint32_t npages, uint32_t flags) {
+    int err = check_range(vaddr, npages);
+    if (err)
+        return err;
+    if (paddr & (PAGE_SIZE_BYTES - 1))
+        return MAP_EINVAL;
+    if (stash_tables(tables_needed(pd_root, vaddr, paddr, npages, flags)))
+        return MAP_ENOMEM;
+
+    uint32_t pte_flags = (flags & ~(PTE_FRAME_MASK | PDE_LARGE)) | PTE_PRESENT;
+    while (npages) {
+        uint32_t *pde = pde_word(pd_root, vaddr);
+        uint32_t pti = pt_index(vaddr);
+        uint32_t n = 1024 - pti;
+        if (n > npages)
+            n = npages;
+
+        int kind = chunk_kind(*pde, vaddr, paddr, npages, flags);
+        //entries that already hold the new mapping, give or take the
+        //accessed and dirty bits the CPU sets, are left alone so mapping a
+        //range again costs no flush
+        if (kind == CHUNK_LARGE) {
+            uint32_t old = *pde;
+            uint32_t entry = paddr | pte_flags | PDE_LARGE;
+            if ((old & ~PTE_USED_BITS) != entry) {
+                *pde = entry;
+                if ((old & PTE_PRESENT) && paging_enabled)
+                    flush_page(vaddr);
+            }
+        } else if (kind == CHUNK_PTES) {
+            uint32_t *pt = get_pt(pd_root, vaddr, 1);
+            uint32_t entry = paddr | pte_flags;
+            for (uint32_t i = 0; i < n; i++, entry += PAGE_SIZE_BYTES) {
+                uint32_t old = pt[pti + i];
+                if ((old & ~PTE_USED_BITS) == entry)
+                    continue;
+                pt[pti + i] = entry;
+                if ((old & PTE_PRESENT) && paging_enabled)
+                    flush_page(vaddr + i * PAGE_SIZE_BYTES);
             }
+        }
+        vaddr += n * PAGE_SIZE_BYTES;
+        paddr += n * PAGE_SIZE_BYTES;
+        npages -= n;
+    }
+    unstash_tables();
+    return MAP_OK;
+}
+
+//Clear the entries for [vaddr, vaddr + npages). Holes are skipped; a
+//4 MiB page only partly covered by the range is split first. Tables left
+//with no entries are freed.
+static int do_unmap_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t npages) {
+    int err = check_range(vaddr, npages);
+    if (err)
+        return err;
 
-            struct page *new_pt = pt_pool[next_free_pt++];
-
-            //Zero the PT entries
-            for (int i = 0; i < 1024; i++) {
-                new_pt[i].present  = 0;
-                new_pt[i].rw       = 0;
-                new_pt[i].user     = 0;
-                new_pt[i].accessed = 0;
-                new_pt[i].dirty    = 0;
-                new_pt[i].unused   = 0;
-                new_pt[i].frame    = 0;
+    while (npages) {
+        uint32_t *pde = pde_word(pd_root, vaddr);
+        uint32_t pti = pt_index(vaddr);
+        uint32_t n = 1024 - pti;
+        if (n > npages)
+            n = npages;
+
+        if ((*pde & PDE_LARGE) && n == 1024) {
+            *pde = 0;
+            if (paging_enabled)
+                flush_page(vaddr);
+        } else if (*pde & PTE_PRESENT) {
+            uint32_t *pt = get_pt(pd_root, vaddr, 0);
+            if (!pt)
+                return MAP_ENOMEM;
+            for (uint32_t i = 0; i < n; i++) {
+                if (!(pt[pti + i] & PTE_PRESENT))
+                    continue;
+                pt[pti + i] = 0;
+                if (paging_enabled)
+                    flush_page(vaddr + i * PAGE_SIZE_BYTES);
             }
+            if (pt_empty(pt))
+                free_pt(pd_root, pd_index(vaddr));
+        }
+        vaddr += n * PAGE_SIZE_BYTES;
+        npages -= n;
+    }
+    return MAP_OK;
+}
+
+int map_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t paddr,
+              uint32_t npages, uint32_t flags) {
+    uint32_t lock = vmm_lock_take();
+    int err = do_map_range(pd_root, vaddr, paddr, npages, flags);
+    vmm_lock_drop(lock);
+    return err;
+}
+
+int unmap_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t npages) {
+    uint32_t lock = vmm_lock_take();
+    int err = do_unmap_range(pd_root, vaddr, npages);
+    vmm_lock_drop(lock);
+    return err;
+}
+
+//Map a linked list of physical page runs to virtual address. Returns
+//vaddr, or NULL if a run couldn't be mapped.
+void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_root) {
+    uint32_t virt_addr = (uint32_t)vaddr;
+
+    for (struct ppage *run = pglist; run != NULL; run = run->next) {
+        uint32_t npages = run->npages ? run->npages : 1;
+        if (map_range(pd_root, virt_addr, (uint32_t)run->physical_addr, npages, PTE_RW) != MAP_OK)
+            return NULL;
+        virt_addr += npages * PAGE_SIZE_BYTES;
+    }
+    return vaddr;
+}
+
+//Set up page tables for npages at vaddr but leave every PTE not present.
+//Fails if any page in the range is already mapped.
+static int do_reserve_pages(void *vaddr, unsigned int npages, struct page_directory_entry *pd_root) {
+    uint32_t va = (uint32_t)vaddr;
+    int err = check_range(va, npages);
+    if (err)
+        return err;
+
+    for (unsigned int i = 0; i < npages; i++) {
+        uint32_t page = va + i * PAGE_SIZE_BYTES;
+        uint32_t pde = *pde_word(pd_root, page);
+        if (pde & PDE_LARGE)
+            return MAP_EEXIST;
+        if ((pde & PTE_PRESENT) && (pt_of(pd_root, pd_index(page))[pt_index(page)] & PTE_PRESENT))
+            return MAP_EEXIST;
+    }
+
+    if (stash_tables(tables_needed(pd_root, va, 0, npages, 0)))
+        return MAP_ENOMEM;
+    for (uint32_t page = va; page < va + npages * PAGE_SIZE_BYTES;
+         page = (page & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE)
+        get_pt(pd_root, page, 1);
+    unstash_tables();
+    return MAP_OK;
+}
+
+int reserve_pages(void *vaddr, unsigned int npages, struct page_directory_entry *pd_root) {
+    uint32_t lock = vmm_lock_take();
+    int err = do_reserve_pages(vaddr, npages, pd_root);
+    vmm_lock_drop(lock);
+    return err;
+}
 
-            //Install PDE
-            pd_root[pdi].present       = 1;
-            pd_root[pdi].rw            = 1;
-            pd_root[pdi].user          = 0;
-            pd_root[pdi].writethru     = 0;
-            pd_root[pdi].cachedisabled = 0;
-            pd_root[pdi].accessed      = 0;
-            pd_root[pdi].pagesize      = 0;
-            pd_root[pdi].ignored       = 0;
-            pd_root[pdi].os_specific   = 0;
-            pd_root[pdi].frame         = ((uint32_t)new_pt) >> 12;
+//Unmap one page and return the frame it was mapped to, NULL if none
+static void *do_unmap_page(void *vaddr, struct page_directory_entry *pd_root) {
+    uint32_t va = (uint32_t)vaddr;
+    uint32_t pde = *pde_word(pd_root, va);
+    uint32_t frame;
+
+    if (!(pde & PTE_PRESENT))
+        return NULL;
+    if (pde & PDE_LARGE) {
+        frame = (pde & PTE_FRAME_MASK) + (va & (LARGE_PAGE_SIZE - 1) & PTE_FRAME_MASK);
+    } else {
+        uint32_t pte = pt_of(pd_root, pd_index(va))[pt_index(va)];
+        if (!(pte & PTE_PRESENT))
+            return NULL;
+        frame = pte & PTE_FRAME_MASK;
+    }
+    if (do_unmap_range(pd_root, va & PTE_FRAME_MASK, 1) != MAP_OK)
+        return NULL;
+    return (void *)frame;
+}
+
+void *unmap_page(void *vaddr, struct page_directory_entry *pd_root) {
+    uint32_t lock = vmm_lock_take();
+    void *frame = do_unmap_page(vaddr, pd_root);
+    vmm_lock_drop(lock);
+    return frame;
+}
+
+//Lookups in the active directory. With paging on, the PDE is one load from
+//PD_WINDOW and the PTE one load from PT_WINDOW; before that memory is
+//addressed physically.
+uint32_t *vmm_get_pte(const void *vaddr) {
+    uint32_t va = (uint32_t)vaddr;
+    uint32_t pde = paging_enabled ? ((uint32_t *)PD_WINDOW)[pd_index(va)] : *pde_word(pd, va);
+
+    if (!(pde & PTE_PRESENT) || (pde & PDE_LARGE))
+        return NULL;
+    if (paging_enabled)
+        return &((uint32_t *)PT_WINDOW)[va >> 12];
+    return &((uint32_t *)(pde & PTE_FRAME_MASK))[pt_index(va)];
+}
+
+uint32_t virt_to_phys(const void *vaddr) {
+    uint32_t va = (uint32_t)vaddr;
+    if (!paging_enabled)
+        return va;
+
+    uint32_t pde = ((uint32_t *)PD_WINDOW)[pd_index(va)];
+    if (!(pde & PTE_PRESENT))
+        return VIRT_TO_PHYS_NONE;
+    if (pde & PDE_LARGE)
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (va & (LARGE_PAGE_SIZE - 1));
+
+    uint32_t pte = ((uint32_t *)PT_WINDOW)[va >> 12];
+    if (!(pte & PTE_PRESENT))
+        return VIRT_TO_PHYS_NONE;
+    return (pte & PTE_FRAME_MASK) | (va & (PAGE_SIZE_BYTES - 1));
+}
+
+//print helper for vmm_dump: one line per run of pages that are contiguous
+//in both address spaces and have the same attributes
+#define VMM_ATTR_MASK (PTE_RW | PTE_USER | PTE_PWT | PTE_PCD)
+
+struct vmm_run {
+    uint32_t va;
+    uint32_t pa;
+    uint32_t npages;
+    uint32_t attr;
+    uint32_t large;         //pages of the run mapped by 4 MiB PDEs
+};
+
+static void vmm_print_run(const struct vmm_run *run) {
+    if (!run->npages)
+        return;
+    esp_sink_printf(vga_sink, NULL, "  0x%08x-0x%08x -> 0x%08x %s%s%s %d KiB%s\n",
+                    run->va, run->va + run->npages * PAGE_SIZE_BYTES - 1, run->pa,
+                    run->attr & PTE_RW ? "rw" : "ro",
+                    run->attr & PTE_USER ? " user" : "",
+                    run->attr & PTE_PCD ? " uncached" : "",
+                    run->npages * 4,
+                    run->large == run->npages ? " (4M)" : "");
+}
+
+static void vmm_add(struct vmm_run *run, uint32_t va, uint32_t pa, uint32_t npages,
+                    uint32_t attr, int large) {
+    if (run->npages && run->va + run->npages * PAGE_SIZE_BYTES == va &&
+        run->pa + run->npages * PAGE_SIZE_BYTES == pa && run->attr == attr) {
+        run->npages += npages;
+    } else {
+        vmm_print_run(run);
+        run->va = va;
+        run->pa = pa;
+        run->attr = attr;
+        run->npages = npages;
+        run->large = 0;
+    }
+    if (large)
+        run->large += npages;
+}
+
+void vmm_dump(void) {
+    struct vmm_run run = { 0 };
+
+    esp_sink_printf(vga_sink, NULL, "Virtual memory map:\n");
+    for (uint32_t pdi = 0; pdi < PD_RECURSIVE_SLOT; pdi++) {
+        uint32_t pde = ((uint32_t *)pd)[pdi];
+        if (!(pde & PTE_PRESENT))
+            continue;
+
+        if (pde & PDE_LARGE) {
+            vmm_add(&run, pdi << 22, pde & ~(LARGE_PAGE_SIZE - 1), 1024, pde & VMM_ATTR_MASK, 1);
+            continue;
+        }
+        uint32_t *pt = pt_of(pd, pdi);
+        for (uint32_t i = 0; i < 1024; i++) {
+            if (pt[i] & PTE_PRESENT)
+                vmm_add(&run, (pdi << 22) | (i << 12), pt[i] & PTE_FRAME_MASK, 1,
+                        pt[i] & VMM_ATTR_MASK, 0);
+        }
+    }
+    vmm_print_run(&run);
+    esp_sink_printf(vga_sink, NULL, "  0x%08x-0x%08x page tables (recursive slot)\n", PT_WINDOW, 0xFFFFFFFF);
+}
+
+//Demand paging. A not-present fault inside a registered range gets a
+//fresh frame, filled by the range's callback before it is mapped in.
+#define MAX_FAULT_RANGES 8
+
+struct fault_range {
+    uint32_t start;
+    uint32_t end;
+    fault_fill_t fill;
+    void *priv;
+};
+
+static struct fault_range fault_ranges[MAX_FAULT_RANGES];
+static struct spinlock fault_lock = SPINLOCK_INIT;
+
+int register_fault_range(void *start, uint32_t len, fault_fill_t fill, void *priv) {
+    uint32_t flags = spin_lock_irqsave(&fault_lock);
+    for (int i = 0; i < MAX_FAULT_RANGES; i++) {
+        if (!fault_ranges[i].fill) {
+            fault_ranges[i].start = (uint32_t)start;
+            fault_ranges[i].end = (uint32_t)start + len;
+            fault_ranges[i].priv = priv;
+            fault_ranges[i].fill = fill;
+            spin_unlock_irqrestore(&fault_lock, flags);
+            return 0;
         }
+    }
+    spin_unlock_irqrestore(&fault_lock, flags);
+    return -1;
+}
 
-        //Recover PT VA from PDE's frame
-        struct page *pt_va = (struct page *)((pd_root[pdi].frame) << 12);
+void unregister_fault_range(void *start) {
+    uint32_t flags = spin_lock_irqsave(&fault_lock);
+    for (int i = 0; i < MAX_FAULT_RANGES; i++) {
+        if (fault_ranges[i].fill && fault_ranges[i].start == (uint32_t)start)
+            fault_ranges[i].fill = NULL;
+    }
+    spin_unlock_irqrestore(&fault_lock, flags);
+}
+
+//Copy out the range covering addr so it can be filled without the lock
+static int find_fault_range(uint32_t addr, struct fault_range *out) {
+    int found = 0;
+    uint32_t flags = spin_lock_irqsave(&fault_lock);
+    for (int i = 0; i < MAX_FAULT_RANGES && !found; i++) {
+        struct fault_range *r = &fault_ranges[i];
+        if (r->fill && addr >= r->start && addr < r->end) {
+            *out = *r;
+            found = 1;
+        }
+    }
+    spin_unlock_irqrestore(&fault_lock, flags);
+    return found;
+}
 
-        //Fill the PTE
-        pt_va[pti].present  = 1;
-        pt_va[pti].rw       = 1;
-        pt_va[pti].user     = 0;
-        pt_va[pti].accessed = 0;
-        pt_va[pti].dirty    = 0;
-        pt_va[pti].unused   = 0;
-        pt_va[pti].frame    = ((uint32_t)current_page->physical_addr) >> 12;
+static void page_fault_handler(struct interrupt_frame *frame) {
+    uint32_t addr;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(addr));
 
-        //Next page
-        current_page = current_page->next;
-        virt_addr += PAGE_SIZE_BYTES;
+    //only not-present faults can be demand paged, not protection faults
+    if (!(frame->error_code & PF_PRESENT)) {
+        uint32_t page = addr & ~(PAGE_SIZE_BYTES - 1);
+        struct fault_range r;
+        if (find_fault_range(addr, &r)) {
+            //fill through the frame's identity mapping so DMA sees a bus
+            //address, then make it visible at the faulting page. An
+            //identity mapping made just for the fill is taken down again
+            //either way, or it would outlive the frame.
+            struct ppage *pg = allocate_physical_pages(1);
+            if (pg) {
+                uint32_t phys = (uint32_t)pg->physical_addr;
+                int temp = virt_to_phys((void *)phys) != phys;
+                int ok = (!temp || map_range(pd, phys, phys, 1, PTE_RW) == MAP_OK) &&
+                         r.fill(r.priv, page - r.start, pg->physical_addr) == 0;
+                if (temp)
+                    unmap_range(pd, phys, 1);
+                if (ok && map_range(pd, page, phys, 1, PTE_RW) == MAP_OK)
+                    return;
+                free_physical_pages(pg);
+            }
+        }
     }
 
-    return vaddr;
+    esp_sink_printf(vga_sink, NULL, "Page fault at %x\n", addr);
+    unhandled_exception(frame);
+}
+
+void page_fault_init(void) {
+    register_interrupt_handler(EXCEPTION_PAGE_FAULT, page_fault_handler);
 }
 
 void enable_paging(void) {
     extern char _end_kernel;
 
-    //Initialize page directory to all zeros
-    for (int i = 0; i < 1024; i++) {
-    pd[i].present       = 0;
-        pd[i].rw            = 0;
-        pd[i].user          = 0;
-        pd[i].writethru     = 0;
-        pd[i].cachedisabled = 0;
-        pd[i].accessed      = 0;
-        pd[i].pagesize      = 0;
-        pd[i].ignored       = 0;
-        pd[i].os_specific   = 0;
-        pd[i].frame         = 0;
-}
-   next_free_pt = 0;
-   //Identity map kernel from 0x100000 to _end_kernel
+    //pd starts out zeroed in .bss. It is not cleared here so that pages
+    //mapped before paging is turned on (e.g. heap slabs) stay mapped.
+
+    //Identity map the kernel from 0x100000 to _end_kernel. With PSE the
+    //first 4 MiB (low memory, VGA and the kernel image) is a single 4 MiB
+    //page and anything beyond goes in as large pages plus 4 KiB edges.
     uint32_t kernel_start = 0x100000;
     uint32_t kernel_end = (uint32_t)&_end_kernel;
     kernel_end = (kernel_end + (PAGE_SIZE_BYTES - 1)) & ~(PAGE_SIZE_BYTES - 1);
 
-    esp_printf(vga_putc, "Mapping kernel from %x to %x\n", kernel_start, kernel_end);
-    for (uint32_t addr = kernel_start; addr < kernel_end; addr += PAGE_SIZE_BYTES) {
-        struct ppage tmp;
-        tmp.next = NULL;
-        tmp.prev = NULL;
-        tmp.physical_addr = (void *)addr;
-        map_pages((void *)addr, &tmp, pd);
+    if (cpu_has_pse()) {
+        uint32_t large_end = (kernel_end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+        log_debug("Mapping %x to %x with 4 MiB pages\n", 0, large_end);
+        if (map_range(pd, 0, 0, large_end / PAGE_SIZE_BYTES, PTE_RW | PDE_LARGE))
+            log_err("Failed to map kernel\n");
+    } else {
+        log_debug("Mapping kernel from %x to %x\n", kernel_start, kernel_end);
+        if (map_range(pd, kernel_start, kernel_start, (kernel_end - kernel_start) / PAGE_SIZE_BYTES, PTE_RW))
+            log_err("Failed to map kernel\n");
     }
-    
+
+    //Identity map the frame descriptor array as one run
+    if (pfa_meta_end > pfa_meta_start) {
+        log_debug("Mapping frame descriptors from %x to %x\n", pfa_meta_start, pfa_meta_end);
+        if (map_range(pd, pfa_meta_start, pfa_meta_start,
+                      (pfa_meta_end - pfa_meta_start) / PAGE_SIZE_BYTES, PTE_RW | PDE_LARGE))
+            log_err("Failed to map frame descriptors\n");
+    }
+
     // Identity map the current stack
     uint32_t esp;
     __asm__ __volatile__("mov %%esp, %0" : "=r"(esp));
-    uint32_t stack_base = esp & ~(PAGE_SIZE_BYTES -1); 
-
-    for (int i = 0; i < 4; i++) {
-        uint32_t saddr = stack_base - (uint32_t)i * PAGE_SIZE_BYTES;
-        esp_printf(vga_putc, "Mapping stack page at %x\n", saddr);
-        struct ppage stack_tmp;
-        stack_tmp.next = NULL;
-        stack_tmp.prev = NULL;
-        stack_tmp.physical_addr = (void *)saddr;
-        map_pages((void *)saddr, &stack_tmp, pd);
-    }
-//Identity map video memory at 0xB8000
-    esp_printf(vga_putc, "Mapping video memory at %x\n", 0xB8000);
-    struct ppage video_tmp;
-    video_tmp.next = NULL;
-    video_tmp.prev = NULL;
-    video_tmp.physical_addr = (void *)0xB8000;
-    map_pages((void *)0xB8000, &video_tmp, pd);
+    uint32_t stack_base = (esp & ~(PAGE_SIZE_BYTES - 1)) - 3 * PAGE_SIZE_BYTES;
+    log_debug("Mapping stack pages at %x\n", stack_base);
+    if (map_range(pd, stack_base, stack_base, 4, PTE_RW))
+        log_err("Failed to map stack\n");
+
+    //Identity map the 32 KiB of text video memory at 0xB8000; the console
+    //scrolls through all of it
+    log_debug("Mapping video memory at %x\n", 0xB8000);
+    if (map_range(pd, 0xB8000, 0xB8000, 8, PTE_RW))
+        log_err("Failed to map video memory\n");
+
+    //The last PD slot points at pd itself, so every page table shows up
+    //in the 4 MiB at PT_WINDOW. The slot below it holds the temp window.
+    ((uint32_t *)pd)[PD_RECURSIVE_SLOT] = (uint32_t)pd | PTE_PRESENT | PTE_RW;
+    if (!get_pt(pd, KMAP_TEMP, 1))
+        log_err("Failed to allocate the temp window table\n");
+
+    //4 MiB PDEs need CR4.PSE
+    if (cpu_has_pse()) {
+        __asm__ __volatile__(
+            "mov %%cr4, %%eax\n\t"
+            "or  $0x10, %%eax\n\t"
+            "mov %%eax, %%cr4"
+            ::: "eax", "memory");
+    }
 
     //Load CR3
     __asm__ __volatile__("mov %0, %%cr3" :: "r"(pd) : "memory");
@@ -223,5 +1029,6 @@ void enable_paging(void) {
         ::: "eax","memory"
     );
 
-    esp_printf(vga_putc, "Paging enabled!\n");
+    paging_enabled = 1;
+    log_info("Paging enabled!\n");
 }
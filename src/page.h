@@ -9,16 +9,28 @@ struct ppage {
     struct ppage *next;
     struct ppage *prev;
     void *physical_addr;
+    unsigned int npages;   //number of contiguous pages in the run starting here
+    uint8_t order;         //buddy order of the free block headed by this page
+    uint8_t is_free;       //set while this page heads a block on a free list
+    void *owner;           //slab this page belongs to, set by kmalloc
 };
 
-#define NUM_PHYSICAL_PAGES 128
 #define PAGE_SIZE_BYTES 4096
+#define LARGE_PAGE_SIZE 0x400000
 
-extern struct ppage *free_page_list;
+//buddy orders 0..PFA_MAX_ORDER-1, so the largest block is 2^10 pages (4 MiB)
+#define PFA_MAX_ORDER 11
 
-void init_pfa_list(void);
+struct multiboot_info;
+
+//init_pfa_list() builds the frame descriptors from the multiboot2 memory
+//map, leaving out low memory, the kernel image and boot modules.
+//allocate_physical_pages() returns one descriptor heading npages physically
+//contiguous frames. free_physical_pages() takes a list of such runs.
+void init_pfa_list(const struct multiboot_info *mbi);
 struct ppage *allocate_physical_pages(unsigned int npages);
 void free_physical_pages(struct ppage *ppage_list);
+struct ppage *phys_to_ppage(void *addr);
 
 void print_pfa_state(void);
 
@@ -51,10 +63,64 @@ struct page
 //Page directory
 extern struct page_directory_entry pd[1024];
 
-//Paging API
+//Bits of a page directory or page table entry as a 32-bit word
+#define PTE_PRESENT    0x001
+#define PTE_RW         0x002
+#define PTE_USER       0x004
+#define PTE_PWT        0x008
+#define PTE_PCD        0x010
+#define PTE_ACCESSED   0x020
+#define PTE_DIRTY      0x040
+#define PDE_LARGE      0x080    // PDE maps a 4 MiB page (needs CR4.PSE)
+#define PTE_FRAME_MASK 0xFFFFF000
+
+//Virtual layout of the top of the address space. PD slot 1023 maps the
+//page directory onto itself, so page table i is visible at
+//PT_WINDOW + i * 4096 and the directory at PD_WINDOW. One page below that
+//is a window for temporarily mapping a frame. Mappings stay below VMM_TOP.
+#define PD_RECURSIVE_SLOT 1023
+#define PT_WINDOW  0xFFC00000
+#define PD_WINDOW  0xFFFFF000
+#define KMAP_TEMP  0xFF800000
+#define VMM_TOP    0xFF800000
+
+//Return codes of the mapping functions
+#define MAP_OK      0
+#define MAP_ENOMEM -1           // out of frames for page tables
+#define MAP_EINVAL -2           // unaligned or empty range
+#define MAP_EEXIST -3           // range already has mapped pages
+
+//Paging API. map_range/unmap_range work on page aligned addresses;
+//flags are PTE_* bits (PTE_PRESENT is implied). PDE_LARGE asks for 4 MiB
+//pages wherever the range allows it.
+int map_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t paddr,
+              uint32_t npages, uint32_t flags);
+int unmap_range(struct page_directory_entry *pd_root, uint32_t vaddr, uint32_t npages);
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_root);
+int reserve_pages(void *vaddr, unsigned int npages, struct page_directory_entry *pd_root);
+void *unmap_page(void *vaddr, struct page_directory_entry *pd_root);
 void enable_paging(void);
 
+//Lookups in the active page directory, O(1) through the recursive slot.
+//virt_to_phys() returns VIRT_TO_PHYS_NONE for an unmapped address.
+//vmm_get_pte() returns the PTE for a page mapped through a page table, or
+//NULL (no table, or a 4 MiB page). vmm_dump() prints merged mapped ranges.
+#define VIRT_TO_PHYS_NONE 0xFFFFFFFF
+uint32_t virt_to_phys(const void *vaddr);
+uint32_t *vmm_get_pte(const void *vaddr);
+void vmm_dump(void);
+
+//Demand paging. fill() gets the offset of the faulting page within the
+//range and a frame to fill; it returns 0 to have the frame mapped in.
+#define PF_PRESENT 0x01         //error code bit: fault on a present page
+#define PF_WRITE   0x02
+
+typedef int (*fault_fill_t)(void *priv, uint32_t offset, void *frame);
+
+void page_fault_init(void);
+int register_fault_range(void *start, uint32_t len, fault_fill_t fill, void *priv);
+void unregister_fault_range(void *start);
+
 
 
 #endif
@@ -0,0 +1,55 @@
+#include "pci.h"
+#include "io.h"
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)(slot & 0x1F) << 11) |
+           ((uint32_t)(func & 0x07) << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, val);
+}
+
+//Brute-force scan of every bus/slot/function for the first device with a
+//matching class and subclass. Returns 0 and fills dev when found.
+int pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *dev) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            uint8_t nfuncs = 1;
+            for (uint8_t func = 0; func < nfuncs; func++) {
+                uint32_t id = pci_config_read32(bus, slot, func, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                    continue;
+
+                //multi-function devices have bit 7 set in the header type
+                if (func == 0 && (pci_config_read32(bus, slot, 0, PCI_HEADER_TYPE) & 0x00800000))
+                    nfuncs = 8;
+
+                uint32_t cls = pci_config_read32(bus, slot, func, PCI_CLASS_REVISION);
+                if ((cls >> 24) != class_code || ((cls >> 16) & 0xFF) != subclass)
+                    continue;
+
+                dev->bus = bus;
+                dev->slot = slot;
+                dev->func = func;
+                dev->class_code = cls >> 24;
+                dev->subclass = (cls >> 16) & 0xFF;
+                dev->prog_if = (cls >> 8) & 0xFF;
+                dev->vendor_id = id & 0xFFFF;
+                dev->device_id = id >> 16;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
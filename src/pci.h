@@ -0,0 +1,35 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+/*
+ * PCI configuration space access through the legacy 0xCF8/0xCFC ports
+ *
+ */
+
+#define PCI_VENDOR_ID       0x00
+#define PCI_COMMAND         0x04
+#define PCI_CLASS_REVISION  0x08
+#define PCI_HEADER_TYPE     0x0C
+#define PCI_BAR4            0x20
+
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_BUS_MASTER  0x0004
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint16_t vendor_id;
+    uint16_t device_id;
+};
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val);
+int pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *dev);
+
+#endif
@@ -16,13 +16,40 @@
 /* that is unacceptable in most embedded systems.    */
 /*---------------------------------------------------*/
 
-static func_ptr out_char;
-static int do_padding;
-static int left_flag;
-static int len;
-static int num1;
-static int num2;
-static char pad_character;
+/* All formatting state lives in one of these on the  */
+/* caller's stack, so calls from interrupt handlers   */
+/* can't disturb a call in progress. Output is        */
+/* collected in buf and handed to the sink in chunks. */
+#define FMT_CHUNK 64
+
+struct fmt_state {
+   esp_sink_t sink;
+   void *ctx;
+   char buf[FMT_CHUNK];
+   int nbuf;
+   int total;
+   int do_padding;
+   int left_flag;
+   int len;
+   int num1;
+   int num2;
+   char pad_character;
+};
+
+static void flush_out(struct fmt_state *st)
+{
+   if (st->nbuf)
+      st->sink(st->ctx, st->buf, st->nbuf);
+   st->nbuf = 0;
+}
+
+static void out_char(struct fmt_state *st, char c)
+{
+   st->buf[st->nbuf++] = c;
+   st->total++;
+   if (st->nbuf == FMT_CHUNK)
+      flush_out(st);
+}
 
 size_t strlen(const char *str) {
     unsigned int len = 0;
@@ -33,8 +60,8 @@ size_t strlen(const char *str) {
 }
 
 int tolower(int c) {
-    if(c < 'a') { // Check if c is uppercase
-        c -= 'a' - 'A';
+    if((c >= 'A') && (c <= 'Z')) { // Check if c is uppercase
+        c += 'a' - 'A';
     }
     return c;
 }
@@ -55,13 +82,13 @@ int isdig(int c) {
 /* This routine puts pad characters into the output  */
 /* buffer.                                           */
 /*                                                   */
-static void padding( const int l_flag)
+static void padding( struct fmt_state *st, const int l_flag)
 {
    int i;
 
-   if (do_padding && l_flag && (len < num1))
-      for (i=len; i<num1; i++)
-          out_char( pad_character);
+   if (st->do_padding && l_flag && (st->len < st->num1))
+      for (i=st->len; i<st->num1; i++)
+          out_char( st, st->pad_character);
    }
 
 /*---------------------------------------------------*/
@@ -69,21 +96,22 @@ static void padding( const int l_flag)
 /* This routine moves a string to the output buffer  */
 /* as directed by the padding and positioning flags. */
 /*                                                   */
-static void outs( charptr lp)
+static void outs( struct fmt_state *st, charptr lp)
 {
    if(lp == NULL)
       lp = "(null)";
    /* pad on left if needed                          */
-   len = strlen( lp);
-   padding( !left_flag);
+   st->len = strlen( lp);
+   if (st->len > st->num2)
+      st->len = st->num2;
+   padding( st, !st->left_flag);
 
    /* Move string to the buffer                      */
-   while (*lp && num2--)
-      out_char( *lp++);
+   for (int i = 0; i < st->len; i++)
+      out_char( st, *lp++);
 
    /* Pad on right if needed                         */
-   len = strlen( lp);
-   padding( left_flag);
+   padding( st, st->left_flag);
    }
 
 /*---------------------------------------------------*/
@@ -91,7 +119,7 @@ static void outs( charptr lp)
 /* This routine moves a number to the output buffer  */
 /* as directed by the padding and positioning flags. */
 /*                                                   */
-static void outnum(unsigned int num, const int base)
+static void outnum( struct fmt_state *st, unsigned int num, const int base)
 {
    charptr cp;
    int negative;
@@ -118,11 +146,11 @@ static void outnum(unsigned int num, const int base)
 
    /* Move the converted number to the buffer and    */
    /* add in the padding where needed.               */
-   len = strlen(outbuf);
-   padding( !left_flag);
+   st->len = strlen(outbuf);
+   padding( st, !st->left_flag);
    while (cp >= outbuf)
-      out_char( *cp--);
-   padding( left_flag);
+      out_char( st, *cp--);
+   padding( st, st->left_flag);
 }
 
 /*---------------------------------------------------*/
@@ -156,10 +184,21 @@ static int getnum( charptr* linep)
 /* the supported formats.                            */
 /*                                                   */
 
+/* esp_printf/esp_vprintf take a function that     */
+/* prints one character; the chunks are passed to it */
+/* one character at a time.                          */
+static void char_sink(void *ctx, const char *chunk, size_t n)
+{
+   func_ptr f_ptr = (func_ptr)ctx;
+
+   while (n--)
+      f_ptr(*chunk++);
+   }
+
 void esp_printf( const func_ptr f_ptr, charptr ctrl, ...)
 {
   va_list args;
-  va_start(args, *ctrl);
+  va_start(args, ctrl);
   esp_vprintf(f_ptr, ctrl, args);
   va_end( args );
   
@@ -167,45 +206,117 @@ void esp_printf( const func_ptr f_ptr, charptr ctrl, ...)
 
 void esp_vprintf( const func_ptr f_ptr, charptr ctrl, va_list argp)
 {
+   esp_sink_vprintf(char_sink, (void *)f_ptr, ctrl, argp);
+   }
+
+int esp_sink_printf( esp_sink_t sink, void *ctx, const char *ctrl, ...)
+{
+   va_list args;
+   int n;
+
+   va_start(args, ctrl);
+   n = esp_sink_vprintf(sink, ctx, ctrl, args);
+   va_end(args);
+   return n;
+   }
+
+/* Bounded output into a buffer. Like snprintf the   */
+/* result is always terminated (if size > 0) and the */
+/* return value is the length the whole output would */
+/* have had.                                         */
+struct sn_buffer {
+   char *buf;
+   size_t size;
+   size_t pos;
+};
+
+static void buffer_sink(void *ctx, const char *chunk, size_t n)
+{
+   struct sn_buffer *sb = ctx;
+
+   while (n--) {
+      if (sb->pos + 1 < sb->size)
+         sb->buf[sb->pos++] = *chunk;
+      chunk++;
+      }
+   }
+
+int esp_vsnprintf( char *buf, size_t size, const char *ctrl, va_list argp)
+{
+   struct sn_buffer sb = { buf, size, 0 };
+   int n;
+
+   n = esp_sink_vprintf(buffer_sink, &sb, ctrl, argp);
+   if (size)
+      buf[sb.pos] = 0;
+   return n;
+   }
+
+int esp_snprintf( char *buf, size_t size, const char *ctrl, ...)
+{
+   va_list args;
+   int n;
+
+   va_start(args, ctrl);
+   n = esp_vsnprintf(buf, size, ctrl, args);
+   va_end(args);
+   return n;
+   }
+
+void esp_sprintf( char *buf, char *ctrl, ...)
+{
+   va_list args;
+
+   va_start(args, ctrl);
+   esp_vsnprintf(buf, (size_t)-1 / 2, ctrl, args);
+   va_end(args);
+   }
+
+int esp_sink_vprintf( esp_sink_t sink, void *ctx, const char *fmt, va_list argp)
+{
+   struct fmt_state state;
+   struct fmt_state *st = &state;
+   charptr ctrl = (charptr)fmt;
 
    int long_flag;
    int dot_flag;
 
    char ch;
-   //va_list argp;
-
-   //va_start( argp, ctrl);
-   out_char = f_ptr;
 
+   st->sink = sink;
+   st->ctx = ctx;
+   st->nbuf = 0;
+   st->total = 0;
+   st->num1 = 0;
    for ( ; *ctrl; ctrl++) {
 
       /* move format string chars to buffer until a  */
       /* format control is found.                    */
       if (*ctrl != '%') {
-         out_char(*ctrl);
+         out_char(st, *ctrl);
          continue;
          }
 
       /* initialize all the flags for this format.   */
       dot_flag   =
       long_flag  =
-      left_flag  =
-      do_padding = 0;
-      pad_character = ' ';
-      num2=32767;
+      st->left_flag  =
+      st->do_padding = 0;
+      st->pad_character = ' ';
+      st->num2=32767;
 
 try_next:
       ch = *(++ctrl);
 
       if (isdig((int)ch)) {
          if (dot_flag)
-            num2 = getnum(&ctrl);
+            st->num2 = getnum(&ctrl);
          else {
             if (ch == '0')
-               pad_character = '0';
+               st->pad_character = '0';
 
-            num1 = getnum(&ctrl);
-            do_padding = 1;
+            st->num1 = getnum(&ctrl);
+            st->do_padding = 1;
          }
          ctrl--;
          goto try_next;
@@ -213,11 +324,11 @@ try_next:
 
       switch (tolower((int)ch)) {
          case '%':
-              out_char( '%');
+              out_char( st, '%');
               continue;
 
          case '-':
-              left_flag = 1;
+              st->left_flag = 1;
               break;
 
          case '.':
@@ -231,42 +342,42 @@ try_next:
          case 'i':
          case 'd':
               if (long_flag || ch == 'D') {
-                 outnum( va_arg(argp, long), 10L);
+                 outnum( st, va_arg(argp, long), 10L);
                  continue;
                  }
               else {
-                 outnum( va_arg(argp, int), 10L);
+                 outnum( st, va_arg(argp, int), 10L);
                  continue;
                  }
          case 'x':
-              outnum( (long)va_arg(argp, int), 16L);
+              outnum( st, (long)va_arg(argp, int), 16L);
               continue;
 
          case 's':
-              outs( va_arg( argp, charptr));
+              outs( st, va_arg( argp, charptr));
               continue;
 
          case 'c':
-              out_char( va_arg( argp, int));
+              out_char( st, va_arg( argp, int));
               continue;
 
          case '\\':
               switch (*ctrl) {
                  case 'a':
-                      out_char( 0x07);
+                      out_char( st, 0x07);
                       break;
                  case 'h':
-                      out_char( 0x08);
+                      out_char( st, 0x08);
                       break;
                  case 'r':
-                      out_char( 0x0D);
+                      out_char( st, 0x0D);
                       break;
                  case 'n':
-                      out_char( 0x0D);
-                      out_char( 0x0A);
+                      out_char( st, 0x0D);
+                      out_char( st, 0x0A);
                       break;
                  default:
-                      out_char( *ctrl);
+                      out_char( st, *ctrl);
                       break;
                  }
               ctrl++;
@@ -277,7 +388,8 @@ try_next:
          }
       goto try_next;
       }
-   va_end( argp);
+   flush_out(st);
+   return st->total;
    }
 
 /*---------------------------------------------------*/
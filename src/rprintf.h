@@ -8,13 +8,18 @@
 
 typedef unsigned int  size_t;
 
+#ifndef NULL
 #define NULL (void*)0
+#endif
 
 int isdig(int c); // hand-implemented alternative to isdigit(), which uses a bunch of c library functions I don't want to include.
 
 typedef char* charptr;
 typedef int (*func_ptr)(int c);
 
+//Receives formatted output a chunk at a time
+typedef void (*esp_sink_t)(void *ctx, const char *chunk, size_t n);
+
 ///////////////////////////////////////////////////////////////////////////////
 ////  Common Prototype functions
 /////////////////////////////////////////////////////////////////////////////////
@@ -22,4 +27,11 @@ void esp_sprintf(char *buf, char *ctrl, ...);
 void esp_vprintf( const func_ptr f_ptr, charptr ctrl, va_list argp);
 void esp_printf( const func_ptr f_ptr, charptr ctrl, ...);
 void printk(charptr ctrl, ...);
+
+//Reentrant: each call keeps its state on the stack. The sink versions and
+//esp_snprintf return the number of characters produced.
+int esp_sink_printf( esp_sink_t sink, void *ctx, const char *ctrl, ...);
+int esp_sink_vprintf( esp_sink_t sink, void *ctx, const char *ctrl, va_list argp);
+int esp_snprintf( char *buf, size_t size, const char *ctrl, ...);
+int esp_vsnprintf( char *buf, size_t size, const char *ctrl, va_list argp);
 #endif
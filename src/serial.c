@@ -0,0 +1,75 @@
+#include "serial.h"
+#include "io.h"
+#include <stdint.h>
+
+#define UART_DATA   0               // THR/RBR, divisor low with DLAB set
+#define UART_IER    1               // divisor high with DLAB set
+#define UART_FCR    2
+#define UART_LCR    3
+#define UART_MCR    4
+#define UART_LSR    5
+
+#define LCR_8N1     0x03
+#define LCR_DLAB    0x80
+#define FCR_ENABLE  0xC7            // enable and clear both FIFOs, 14 byte RX trigger
+#define MCR_OUT     0x0B            // DTR, RTS, OUT2
+#define MCR_LOOP    0x1E            // loopback with RTS, OUT1, OUT2
+#define LSR_THRE    0x20            // transmit FIFO empty
+
+#define UART_FIFO_SIZE 16
+#define UART_DIVISOR   1            // 115200 baud
+
+static int serial_ok = 0;
+
+int serial_init(void) {
+    outb(COM1_PORT + UART_IER, 0);              // polled, no interrupts
+    outb(COM1_PORT + UART_LCR, LCR_DLAB);
+    outb(COM1_PORT + UART_DATA, UART_DIVISOR & 0xFF);
+    outb(COM1_PORT + UART_IER, UART_DIVISOR >> 8);
+    outb(COM1_PORT + UART_LCR, LCR_8N1);
+    outb(COM1_PORT + UART_FCR, FCR_ENABLE);
+
+    //a byte sent in loopback mode must come straight back
+    outb(COM1_PORT + UART_MCR, MCR_LOOP);
+    outb(COM1_PORT + UART_DATA, 0xAE);
+    if (inb(COM1_PORT + UART_DATA) != 0xAE) {
+        serial_ok = 0;
+        return -1;
+    }
+
+    outb(COM1_PORT + UART_MCR, MCR_OUT);
+    serial_ok = 1;
+    return 0;
+}
+
+int serial_present(void) {
+    return serial_ok;
+}
+
+//Once the transmit FIFO is empty it takes a whole FIFO's worth of bytes
+//without further status reads
+void serial_write(const char *buf, uint32_t len) {
+    if (!serial_ok)
+        return;
+
+    uint32_t i = 0;
+    while (i < len) {
+        while (!(inb(COM1_PORT + UART_LSR) & LSR_THRE))
+            ;
+        for (int n = 0; n < UART_FIFO_SIZE && i < len; n++, i++) {
+            if (buf[i] == '\n') {
+                if (n == UART_FIFO_SIZE - 1)
+                    break;          // no room for the pair in this burst
+                outb(COM1_PORT + UART_DATA, '\r');
+                n++;
+            }
+            outb(COM1_PORT + UART_DATA, buf[i]);
+        }
+    }
+}
+
+int serial_putc(int c) {
+    char ch = c;
+    serial_write(&ch, 1);
+    return c;
+}
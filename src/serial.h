@@ -0,0 +1,22 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <stdint.h>
+
+/*
+ * Polled driver for the 16550 UART on COM1, 115200 baud 8N1 with the
+ * 16 byte transmit FIFO enabled. If no UART answers the loopback test in
+ * serial_init() output is silently discarded.
+ *
+ */
+
+#define COM1_PORT 0x3F8
+
+int serial_init(void);
+int serial_present(void);
+
+//"\n" goes out as "\r\n"
+int serial_putc(int c);
+void serial_write(const char *buf, uint32_t len);
+
+#endif
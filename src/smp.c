@@ -0,0 +1,593 @@
+#include "smp.h"
+#include "clock.h"
+#include "interrupt.h"
+#include "klib.h"
+#include "kmalloc.h"
+#include "log.h"
+#include "page.h"
+#include "rprintf.h"
+#include "vga.h"
+#include <stdint.h>
+#include <stddef.h>
+
+//Local APIC registers, as byte offsets into its 4 KiB MMIO page
+#define LAPIC_ID       0x020
+#define LAPIC_TPR      0x080
+#define LAPIC_EOI      0x0B0
+#define LAPIC_SVR      0x0F0
+#define LAPIC_ICR_LO   0x300
+#define LAPIC_ICR_HI   0x310
+#define LAPIC_LINT0    0x350
+#define LAPIC_LINT1    0x360
+
+#define SVR_ENABLE     0x100
+#define LVT_MASKED     0x10000
+#define LVT_NMI        0x400
+
+#define ICR_FIXED      0x00004000   // fixed delivery, level assert
+#define ICR_INIT       0x00004500
+#define ICR_STARTUP    0x00004600
+#define ICR_PENDING    0x00001000   // delivery status: not yet accepted
+
+//how long an AP gets to reach ap_entry before we give up on it
+#define AP_START_TIMEOUT_US 100000
+#define AP_LATE             -2      // start_ap: SIPIs sent but no answer
+
+static struct cpu cpus[SMP_MAX_CPUS];
+static uint32_t ncpus = 0;
+static uint32_t lapic_phys = 0;
+static volatile uint32_t *lapic = NULL;
+static uint8_t apic_to_cpu[256];
+
+//set once the local APIC is mapped and cpus[] is in its final order
+static int smp_active = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static inline uint32_t atomic_inc(volatile uint32_t *p) {
+    uint32_t v = 1;
+    __asm__ __volatile__("lock xaddl %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+    return v + 1;
+}
+
+//Discovery. Both the ACPI RSDP and the MP floating pointer sit on a 16 byte
+//boundary in the first KiB of the EBDA or in the BIOS area at 0xE0000.
+//This runs before paging, so physical addresses are used directly.
+
+struct acpi_rsdp {
+    char signature[8];              // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;      // "APIC"
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+#define MADT_LAPIC         0
+#define MADT_LAPIC_ENABLED 0x01
+
+struct mp_floating {
+    char signature[4];              // "_MP_"
+    uint32_t config;
+    uint8_t length;                 // in 16 byte units
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];            // features[0] != 0: a default configuration, no table
+} __attribute__((packed));
+
+struct mp_config {
+    char signature[4];              // "PCMP"
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+#define MP_PROCESSOR      0
+#define MP_PROCESSOR_SIZE 20
+#define MP_OTHER_SIZE     8
+#define MP_CPU_ENABLED    0x01
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_AREA_START  0xE0000
+#define BIOS_AREA_END    0x100000
+
+static int checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+    while (len--)
+        sum += *b++;
+    return sum == 0;
+}
+
+static const void *scan_area(uint32_t start, uint32_t end, const char *sig, uint32_t sig_len,
+                             uint32_t sum_len) {
+    for (uint32_t p = start; p + sum_len <= end; p += 16) {
+        if (!memcmp((const void *)p, sig, sig_len) && checksum_ok((const void *)p, sum_len))
+            return (const void *)p;
+    }
+    return NULL;
+}
+
+static const void *scan_bios(const char *sig, uint32_t sig_len, uint32_t sum_len) {
+    uint32_t ebda = (uint32_t)*(volatile uint16_t *)EBDA_SEGMENT_PTR << 4;
+    const void *found = NULL;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+        found = scan_area(ebda, ebda + 1024, sig, sig_len, sum_len);
+    if (!found)
+        found = scan_area(BIOS_AREA_START, BIOS_AREA_END, sig, sig_len, sum_len);
+    return found;
+}
+
+static void add_cpu(uint32_t apic_id) {
+    if (ncpus == SMP_MAX_CPUS) {
+        log_warn("smp: more than %d processors, ignoring apic %d\n", SMP_MAX_CPUS, apic_id);
+        return;
+    }
+    cpus[ncpus].apic_id = apic_id;
+    ncpus++;
+}
+
+static int madt_detect(void) {
+    const struct acpi_rsdp *rsdp = scan_bios("RSD PTR ", 8, sizeof(struct acpi_rsdp));
+    if (!rsdp)
+        return 0;
+
+    const struct acpi_header *rsdt = (const struct acpi_header *)rsdp->rsdt_address;
+    if (memcmp(rsdt->signature, "RSDT", 4) || !checksum_ok(rsdt, rsdt->length))
+        return 0;
+
+    const uint32_t *tables = (const uint32_t *)(rsdt + 1);
+    uint32_t ntables = (rsdt->length - sizeof(*rsdt)) / 4;
+    for (uint32_t i = 0; i < ntables; i++) {
+        const struct acpi_madt *madt = (const struct acpi_madt *)tables[i];
+        if (memcmp(madt->header.signature, "APIC", 4) || !checksum_ok(madt, madt->header.length))
+            continue;
+
+        lapic_phys = madt->lapic_address;
+        const uint8_t *e = (const uint8_t *)(madt + 1);
+        const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+        //entry: type, length, then for a local APIC the ACPI id, APIC id, flags
+        while (e + 2 <= end && e[1] >= 2) {
+            if (e[0] == MADT_LAPIC && (*(const uint32_t *)(e + 4) & MADT_LAPIC_ENABLED))
+                add_cpu(e[3]);
+            e += e[1];
+        }
+        return ncpus > 0;
+    }
+    return 0;
+}
+
+static int mp_detect(void) {
+    const struct mp_floating *mpf = scan_bios("_MP_", 4, sizeof(struct mp_floating));
+    if (!mpf || mpf->features[0] || !mpf->config)
+        return 0;
+
+    const struct mp_config *cfg = (const struct mp_config *)mpf->config;
+    if (memcmp(cfg->signature, "PCMP", 4) || !checksum_ok(cfg, cfg->length))
+        return 0;
+
+    lapic_phys = cfg->lapic_address;
+    const uint8_t *e = (const uint8_t *)(cfg + 1);
+    for (uint32_t i = 0; i < cfg->entry_count; i++) {
+        //processor entry: type, APIC id, APIC version, flags, ...
+        if (e[0] == MP_PROCESSOR) {
+            if (e[3] & MP_CPU_ENABLED)
+                add_cpu(e[1]);
+            e += MP_PROCESSOR_SIZE;
+        } else {
+            e += MP_OTHER_SIZE;
+        }
+    }
+    return ncpus > 0;
+}
+
+void smp_detect(void) {
+    const char *source = "ACPI MADT";
+
+    if (!madt_detect()) {
+        ncpus = 0;
+        source = "MP table";
+        if (!mp_detect()) {
+            ncpus = 0;
+            lapic_phys = 0;
+            log_info("smp: no ACPI MADT or MP table\n");
+            return;
+        }
+    }
+    log_info("smp: %d processors in the %s, local APIC at %x\n", ncpus, source, lapic_phys);
+}
+
+//Real mode trampoline, copied to TRAMPOLINE_BASE. A SIPI starts the AP at
+//TRAMPOLINE_BASE >> 4 : 0 in real mode. It loads a flat GDT, enters
+//protected mode, turns on paging with the BSP's CR3 and CR4 and calls
+//ap_entry on its own stack, all taken from the parameter block at the end.
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define TRAMP(sym) #sym " - smp_trampoline + " XSTR(TRAMPOLINE_BASE)
+
+__asm__(
+    ".section .rodata\n"
+    ".global smp_trampoline\n"
+    ".global smp_trampoline_params\n"
+    ".global smp_trampoline_end\n"
+    ".code16\n"
+    "smp_trampoline:\n"
+    "    cli\n"
+    "    cld\n"
+    "    xor %ax, %ax\n"
+    "    mov %ax, %ds\n"
+    "    lgdtl " TRAMP(tramp_gdtr) "\n"
+    "    mov %cr0, %eax\n"
+    "    or $1, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    ljmpl $0x08, $" TRAMP(tramp_pm) "\n"
+    ".code32\n"
+    "tramp_pm:\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %gs\n"
+    "    mov %ax, %ss\n"
+    "    mov " TRAMP(tramp_cr4) ", %eax\n"
+    "    mov %eax, %cr4\n"
+    "    mov " TRAMP(tramp_cr3) ", %eax\n"
+    "    mov %eax, %cr3\n"
+    "    mov %cr0, %eax\n"
+    "    or $0x80000000, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    mov " TRAMP(tramp_esp) ", %esp\n"
+    "    mov " TRAMP(tramp_entry) ", %eax\n"
+    "    call *%eax\n"
+    "1:  hlt\n"
+    "    jmp 1b\n"
+    ".p2align 3\n"
+    "tramp_gdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00CF9A000000FFFF\n"
+    "    .quad 0x00CF92000000FFFF\n"
+    "tramp_gdtr:\n"
+    "    .word 23\n"
+    "    .long " TRAMP(tramp_gdt) "\n"
+    ".p2align 2\n"
+    "smp_trampoline_params:\n"
+    "tramp_cr3:   .long 0\n"
+    "tramp_cr4:   .long 0\n"
+    "tramp_esp:   .long 0\n"
+    "tramp_entry: .long 0\n"
+    "smp_trampoline_end:\n"
+    ".text\n");
+
+extern char smp_trampoline[], smp_trampoline_params[], smp_trampoline_end[];
+
+//Layout of the parameter block at smp_trampoline_params
+struct trampoline_params {
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t esp;
+    uint32_t entry;
+};
+
+uint32_t smp_cpu_count(void) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ncpus; i++)
+        n += cpus[i].online ? 1 : 0;
+    return n ? n : 1;
+}
+
+struct cpu *smp_this_cpu(void) {
+    if (!smp_active)
+        return &cpus[0];
+    return &cpus[apic_to_cpu[lapic_read(LAPIC_ID) >> 24]];
+}
+
+uint32_t smp_cpu_index(void) {
+    return smp_this_cpu()->index;
+}
+
+struct cpu *smp_cpu(uint32_t index) {
+    return index < ncpus ? &cpus[index] : NULL;
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+        __asm__ __volatile__("pause");
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    irq_restore(flags);
+}
+
+//Software enable the local APIC. Only the BSP keeps LINT0, which carries
+//the 8259 interrupts in virtual wire mode.
+static void lapic_enable(int bsp) {
+    if (!bsp) {
+        lapic_write(LAPIC_LINT0, LVT_MASKED);
+        lapic_write(LAPIC_LINT1, LVT_NMI);
+    }
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+//Flush this CPU's TLB if someone asked since the last flush. Interrupts
+//are held off so the IPI handler can't interleave and move flush_done back.
+static void flush_pending(struct cpu *cpu) {
+    uint32_t flags = irq_save();
+    uint32_t req = cpu->flush_req;
+    if (req != cpu->flush_done) {
+        __asm__ __volatile__("mov %%cr3, %%eax\n\tmov %%eax, %%cr3" ::: "eax", "memory");
+        cpu->flush_done = req;
+    }
+    irq_restore(flags);
+}
+
+void smp_relax(void) {
+    __asm__ __volatile__("pause" ::: "memory");
+    if (smp_active)
+        flush_pending(smp_this_cpu());
+}
+
+void spin_wait(struct spinlock *lock, uint32_t ticket) {
+    while (lock->owner != ticket)
+        smp_relax();
+}
+
+//The IPI only wakes the CPU: it flushes if asked, and an AP's idle loop
+//then picks up any pending call
+static void ipi_handler(struct interrupt_frame *frame) {
+    flush_pending(smp_this_cpu());
+    lapic_write(LAPIC_EOI, 0);
+}
+
+//no EOI for a spurious interrupt
+static void spurious_handler(struct interrupt_frame *frame) {
+}
+
+void smp_tlb_shootdown(void) {
+    if (!smp_active)
+        return;
+
+    struct cpu *self = smp_this_cpu();
+    uint32_t want[SMP_MAX_CPUS];
+    uint32_t sent = 0;                  // CPUs asked, one bit each
+
+    //a CPU that comes online after the first loop has a fresh TLB and
+    //isn't waited for
+    for (uint32_t i = 0; i < ncpus; i++) {
+        if (&cpus[i] == self || !cpus[i].online)
+            continue;
+        want[i] = atomic_inc(&cpus[i].flush_req);
+        sent |= 1u << i;
+        lapic_send_ipi(cpus[i].apic_id, ICR_FIXED | IPI_VECTOR);
+    }
+    for (uint32_t i = 0; i < ncpus; i++) {
+        if (!(sent & (1u << i)))
+            continue;
+        while ((int32_t)(cpus[i].flush_done - want[i]) < 0)
+            smp_relax();
+    }
+}
+
+int smp_call_on(uint32_t index, void (*fn)(void *arg), void *arg) {
+    if (index >= ncpus || !cpus[index].online || index == smp_cpu_index())
+        return -1;
+
+    struct cpu *cpu = &cpus[index];
+    spin_lock(&cpu->call_lock);
+    while (cpu->call_fn)
+        smp_relax();
+    cpu->call_arg = arg;
+    __asm__ __volatile__("" ::: "memory");
+    cpu->call_fn = fn;
+    spin_unlock(&cpu->call_lock);
+
+    lapic_send_ipi(cpu->apic_id, ICR_FIXED | IPI_VECTOR);
+    return 0;
+}
+
+void smp_call_wait(uint32_t index) {
+    if (index >= ncpus)
+        return;
+    while (cpus[index].call_fn)
+        smp_relax();
+}
+
+//An AP halts until an IPI brings it a call. The check and the halt are
+//done with interrupts off; sti holds them off for one more instruction,
+//so an IPI arriving in between still ends the hlt.
+static void ap_idle(struct cpu *cpu) {
+    for (;;) {
+        __asm__ __volatile__("cli");
+        flush_pending(cpu);
+        void (*fn)(void *arg) = cpu->call_fn;
+        if (!fn) {
+            __asm__ __volatile__("sti\n\thlt" ::: "memory");
+            continue;
+        }
+        enable_interrupts();
+        fn(cpu->call_arg);
+        cpu->calls++;
+        __asm__ __volatile__("" ::: "memory");
+        cpu->call_fn = NULL;
+    }
+}
+
+//First C code on an AP, on its own stack with paging on
+static void ap_entry(void) {
+    interrupts_init_ap();
+    lapic_enable(0);
+
+    struct cpu *cpu = smp_this_cpu();
+    cpu->online = 1;
+    log_info("smp: cpu %d (apic %d) online\n", cpu->index, cpu->apic_id);
+    ap_idle(cpu);
+}
+
+//Returns 0 once the AP is online, -1 if it was never sent a SIPI and
+//AP_LATE if it was but didn't come up in time
+static int start_ap(struct cpu *cpu) {
+    struct ppage *stack = allocate_physical_pages(SMP_STACK_PAGES);
+    if (!stack || !map_pages(stack->physical_addr, stack, pd)) {
+        if (stack)
+            free_physical_pages(stack);
+        log_err("smp: no stack for cpu %d\n", cpu->index);
+        return -1;
+    }
+    cpu->stack = stack;
+
+    struct trampoline_params *params = (struct trampoline_params *)
+        (TRAMPOLINE_BASE + (smp_trampoline_params - smp_trampoline));
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(params->cr3));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(params->cr4));
+    params->esp = (uint32_t)stack->physical_addr + SMP_STACK_PAGES * PAGE_SIZE_BYTES;
+    params->entry = (uint32_t)ap_entry;
+    __asm__ __volatile__("" ::: "memory");
+
+    //INIT, 10 ms, then up to two SIPIs 200 us apart as the MP spec says
+    lapic_send_ipi(cpu->apic_id, ICR_INIT);
+    clock_udelay(10000);
+    for (int sipi = 0; sipi < 2 && !cpu->online; sipi++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        clock_udelay(200);
+    }
+    for (uint32_t waited = 0; !cpu->online && waited < AP_START_TIMEOUT_US; waited += 100)
+        clock_udelay(100);
+
+    if (!cpu->online) {
+        //the stack stays allocated in case the AP turns up late
+        log_warn("smp: cpu %d (apic %d) did not start\n", cpu->index, cpu->apic_id);
+        return AP_LATE;
+    }
+    return 0;
+}
+
+//Needs paging and the IDT; call before interrupts are enabled
+void smp_init(void) {
+    cpus[0].online = 1;
+    if (!ncpus || !lapic_phys) {
+        ncpus = 1;
+        return;
+    }
+
+    if (virt_to_phys((void *)lapic_phys) != lapic_phys &&
+        map_range(pd, lapic_phys, lapic_phys, 1, PTE_RW | PTE_PCD | PTE_PWT) != MAP_OK) {
+        log_err("smp: can't map the local APIC at %x\n", lapic_phys);
+        ncpus = 1;
+        return;
+    }
+    lapic = (volatile uint32_t *)lapic_phys;
+
+    //the BSP goes in slot 0 whatever order the firmware listed it in
+    uint32_t bsp_id = lapic_read(LAPIC_ID) >> 24;
+    uint32_t i;
+    for (i = 0; i < ncpus && cpus[i].apic_id != bsp_id; i++)
+        ;
+    if (i == ncpus) {
+        log_warn("smp: boot processor (apic %d) not in the table\n", bsp_id);
+        i = 0;
+    }
+    cpus[i].apic_id = cpus[0].apic_id;
+    cpus[0].apic_id = bsp_id;
+    for (i = 0; i < ncpus; i++) {
+        cpus[i].index = i;
+        apic_to_cpu[cpus[i].apic_id] = i;
+    }
+
+    register_interrupt_handler(IPI_VECTOR, ipi_handler);
+    register_interrupt_handler(SPURIOUS_VECTOR, spurious_handler);
+    lapic_enable(1);
+    smp_active = 1;
+
+    if (ncpus > 1) {
+        if (virt_to_phys((void *)TRAMPOLINE_BASE) != TRAMPOLINE_BASE &&
+            map_range(pd, TRAMPOLINE_BASE, TRAMPOLINE_BASE, 1, PTE_RW) != MAP_OK) {
+            log_err("smp: can't map the trampoline\n");
+            return;
+        }
+        memcpy((void *)TRAMPOLINE_BASE, smp_trampoline, smp_trampoline_end - smp_trampoline);
+        //a late AP may still read the parameter block, so it must not be
+        //rewritten for the next one
+        for (i = 1; i < ncpus; i++) {
+            if (start_ap(&cpus[i]) == AP_LATE) {
+                log_warn("smp: not starting the remaining processors\n");
+                break;
+            }
+        }
+    }
+    log_info("smp: %d of %d processors online\n", smp_cpu_count(), ncpus);
+}
+
+#ifdef CONFIG_BENCHMARKS
+
+#define SMP_BENCH_ROUNDS 64
+#define SMP_BENCH_BYTES  32768
+
+//Heap and memory traffic: every round allocates, fills and frees a large
+//block, so it also takes the heap, PFA and page table locks
+static void bench_work(void *arg) {
+    for (int r = 0; r < SMP_BENCH_ROUNDS; r++) {
+        uint8_t *buf = kmalloc(SMP_BENCH_BYTES);
+        if (!buf)
+            return;
+        memset(buf, r, SMP_BENCH_BYTES);
+        kfree(buf);
+    }
+}
+
+//The same work on every CPU at once against the BSP alone. With perfect
+//scaling both take the same time.
+void smp_benchmark(void) {
+    uint32_t n = smp_cpu_count();
+    if (n < 2)
+        return;
+
+    uint64_t t0 = rdtsc();
+    bench_work(NULL);
+    uint32_t one = (uint32_t)(rdtsc() - t0) / 1000;
+
+    t0 = rdtsc();
+    for (uint32_t i = 1; i < ncpus; i++)
+        smp_call_on(i, bench_work, NULL);
+    bench_work(NULL);
+    for (uint32_t i = 1; i < ncpus; i++)
+        smp_call_wait(i);
+    uint32_t all = (uint32_t)(rdtsc() - t0) / 1000;
+
+    esp_sink_printf(vga_sink, NULL, "SMP heap work: %d kcycles on 1 cpu, %d kcycles for %d times the work on %d cpus\n",
+                    one, all, n, n);
+}
+
+#endif
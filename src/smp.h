@@ -0,0 +1,69 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+ * Multiprocessor bring-up. smp_detect() runs before paging and reads the
+ * processor list from the ACPI MADT, or from the Intel MP table when
+ * there is no MADT. smp_init() maps the local APIC, copies the real mode
+ * trampoline to TRAMPOLINE_BASE and starts every application processor
+ * (AP) with INIT-SIPI-SIPI.
+ *
+ * Threads, the console and the disk driver stay on the bootstrap
+ * processor (cpu 0). An AP waits in hlt until smp_call_on() hands it a
+ * function, which runs with interrupts on and must not sleep. The page
+ * frame allocator, the page tables, the heap and the log are locked and
+ * can be used from any CPU. The disk driver sleeps through the scheduler,
+ * so the FAT driver fails calls made from any other CPU.
+ *
+ */
+
+#define SMP_MAX_CPUS     8
+#define SMP_STACK_PAGES  4
+
+//one page of low memory, below 1 MiB and never given out by the PFA
+#define TRAMPOLINE_BASE  0x8000
+
+struct ppage;
+
+//Per-CPU data, indexed by smp_cpu_index()
+struct cpu {
+    uint32_t index;
+    uint32_t apic_id;
+    volatile uint32_t online;
+    struct ppage *stack;                    // NULL for the bootstrap processor
+    volatile uint32_t flush_req;            // TLB flushes asked for
+    volatile uint32_t flush_done;           // flush_req as of the last flush
+    struct spinlock call_lock;
+    void (*volatile call_fn)(void *arg);    // set while a call is pending or running
+    void *call_arg;
+    uint32_t calls;
+};
+
+void smp_detect(void);
+void smp_init(void);
+
+uint32_t smp_cpu_count(void);               // CPUs online
+uint32_t smp_cpu_index(void);
+struct cpu *smp_this_cpu(void);
+struct cpu *smp_cpu(uint32_t index);
+
+//Run fn(arg) on another CPU. Waits while an earlier call there is still
+//running; returns -1 if the CPU isn't online.
+int smp_call_on(uint32_t index, void (*fn)(void *arg), void *arg);
+void smp_call_wait(uint32_t index);
+
+//Flush the TLB of every other online CPU and wait until they have. The
+//page table code calls this after changing or removing mappings.
+void smp_tlb_shootdown(void);
+
+//One round of a busy wait: pause and answer any TLB flush request
+void smp_relax(void);
+
+#ifdef CONFIG_BENCHMARKS
+void smp_benchmark(void);
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/*
+ * Ticket spinlocks. A CPU takes the next ticket with lock xadd and waits
+ * until owner reaches it, so the lock is handed out in the order it was
+ * asked for. Only the holder writes owner, and x86 doesn't reorder stores
+ * with earlier loads or stores, so unlocking is a plain increment.
+ *
+ * xadd is a 486 instruction even though the kernel is built for i386. The
+ * TSC clock already needs a Pentium, and every CPU with a local APIC has
+ * xadd, so this costs nothing in practice.
+ *
+ * Waiters spin in spin_wait() (smp.c), which keeps answering TLB shootdown
+ * requests so a CPU spinning with interrupts off can't stall one that
+ * is waiting for it to flush.
+ *
+ */
+
+struct spinlock {
+    volatile uint32_t next;         // ticket the next locker gets
+    volatile uint32_t owner;        // ticket now holding the lock
+};
+
+#define SPINLOCK_INIT { 0, 0 }
+
+void spin_wait(struct spinlock *lock, uint32_t ticket);
+
+static inline uint32_t spin_take_ticket(struct spinlock *lock) {
+    uint32_t ticket = 1;
+    __asm__ __volatile__("lock xaddl %0, %1" : "+r"(ticket), "+m"(lock->next) :: "memory");
+    return ticket;
+}
+
+static inline void spin_lock(struct spinlock *lock) {
+    uint32_t ticket = spin_take_ticket(lock);
+    if (lock->owner != ticket)
+        spin_wait(lock, ticket);
+}
+
+static inline void spin_unlock(struct spinlock *lock) {
+    __asm__ __volatile__("" ::: "memory");
+    lock->owner = lock->owner + 1;
+}
+
+//For locks also taken from interrupt handlers: interrupts stay off while
+//the lock is held so a handler on the same CPU can't spin on it forever
+static inline uint32_t spin_lock_irqsave(struct spinlock *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
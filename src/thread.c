@@ -0,0 +1,261 @@
+#include "thread.h"
+#include "clock.h"
+#include "interrupt.h"
+#include "kmalloc.h"
+#include "log.h"
+#include "page.h"
+#include <stdint.h>
+#include <stddef.h>
+
+static struct thread boot_thread;
+static struct thread *current = NULL;       // NULL until thread_init
+static struct thread *idle = NULL;
+
+static struct thread *run_head = NULL;
+static struct thread *run_tail = NULL;
+static struct thread *sleepers = NULL;
+
+//a thread that exited; its stack is freed by the next thread to run
+static struct thread *zombie = NULL;
+
+static volatile uint32_t ticks = 0;
+static uint32_t next_id = 1;
+
+//Save callee-saved registers and EFLAGS on the current stack, store the
+//stack pointer in *save_esp and resume the thread whose stack is next_esp.
+//A new thread's stack is laid out to "return" into thread_start.
+void thread_switch(uint32_t *save_esp, uint32_t next_esp);
+
+__asm__(
+    ".text\n"
+    ".global thread_switch\n"
+    "thread_switch:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov 8(%esp), %edx\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    pushf\n"
+    "    mov %esp, (%eax)\n"
+    "    mov %edx, %esp\n"
+    "    popf\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n");
+
+static void runq_push(struct thread *t) {
+    t->state = THREAD_RUNNABLE;
+    t->next = NULL;
+    if (run_tail)
+        run_tail->next = t;
+    else
+        run_head = t;
+    run_tail = t;
+}
+
+static struct thread *runq_pop(void) {
+    struct thread *t = run_head;
+    if (t) {
+        run_head = t->next;
+        if (!run_head)
+            run_tail = NULL;
+        t->next = NULL;
+    }
+    return t;
+}
+
+//Runs on the new thread's stack right after every switch
+static void schedule_tail(void) {
+    if (zombie) {
+        if (zombie->stack) {
+            uint32_t base = (uint32_t)zombie->stack->physical_addr;
+            unmap_range(pd, base, THREAD_STACK_PAGES);
+            free_physical_pages(zombie->stack);
+            kfree(zombie);
+        }
+        zombie = NULL;
+    }
+}
+
+//Switch to the next runnable thread, or idle if there is none. Called
+//with interrupts off; a current thread that is still RUNNING goes to the
+//back of the queue, otherwise it is already on a wait or sleep list.
+static void schedule(void) {
+    struct thread *prev = current;
+
+    if (prev->state == THREAD_RUNNING && prev != idle)
+        runq_push(prev);
+
+    struct thread *next = runq_pop();
+    if (!next)
+        next = idle;
+    next->state = THREAD_RUNNING;
+    next->slice = THREAD_SLICE_TICKS;
+    if (next == prev)
+        return;
+
+    current = next;
+    thread_switch(&prev->esp, next->esp);
+    schedule_tail();
+}
+
+static void thread_start(void) {
+    schedule_tail();
+    enable_interrupts();            // we were switched to with them off
+    current->entry(current->arg);
+    thread_exit();
+}
+
+static void idle_main(void *arg) {
+    for (;;) {
+        irq_save();
+        if (run_head)
+            schedule();
+        //sti takes effect after hlt starts, so no wakeup slips in between
+        __asm__ __volatile__("sti\n\thlt" ::: "memory");
+    }
+}
+
+static void timer_handler(struct interrupt_frame *frame) {
+    ticks++;
+
+    for (struct thread **pp = &sleepers; *pp; ) {
+        struct thread *t = *pp;
+        if ((int32_t)(ticks - t->wake_tick) >= 0) {
+            *pp = t->next;
+            runq_push(t);
+        } else {
+            pp = &t->next;
+        }
+    }
+
+    current->ticks++;
+    if (current == idle ? run_head != NULL : --current->slice == 0)
+        schedule();
+}
+
+//A thread with a fresh stack that starts in thread_start, not queued yet
+static struct thread *thread_alloc(const char *name, void (*entry)(void *arg), void *arg) {
+    struct thread *t = kzalloc(sizeof(*t));
+    struct ppage *stack = allocate_physical_pages(THREAD_STACK_PAGES);
+
+    if (!t || !stack || !map_pages(stack->physical_addr, stack, pd)) {
+        if (stack)
+            free_physical_pages(stack);
+        kfree(t);
+        return NULL;
+    }
+
+    t->id = next_id++;
+    t->name = name;
+    t->entry = entry;
+    t->arg = arg;
+    t->stack = stack;
+
+    uint32_t *sp = (uint32_t *)((uint32_t)stack->physical_addr + THREAD_STACK_PAGES * PAGE_SIZE_BYTES);
+    *--sp = 0;                          // thread_start's return address, never used
+    *--sp = (uint32_t)thread_start;     // where thread_switch returns to
+    *--sp = 0;                          // ebp
+    *--sp = 0;                          // ebx
+    *--sp = 0;                          // esi
+    *--sp = 0;                          // edi
+    *--sp = 0x002;                      // eflags, interrupts off
+    t->esp = (uint32_t)sp;
+    return t;
+}
+
+void thread_init(void) {
+    boot_thread.name = "main";
+    boot_thread.state = THREAD_RUNNING;
+    boot_thread.slice = THREAD_SLICE_TICKS;
+    current = &boot_thread;
+
+    idle = thread_alloc("idle", idle_main, NULL);
+    if (!idle) {
+        log_err("No memory for the idle thread\n");
+        current = NULL;
+        return;
+    }
+
+    register_interrupt_handler(IRQ_VECTOR(IRQ_TIMER), timer_handler);
+    pit_start_periodic(THREAD_HZ);
+    pic_unmask_irq(IRQ_TIMER);
+}
+
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg) {
+    if (!current)
+        return NULL;
+
+    struct thread *t = thread_alloc(name, entry, arg);
+    if (t) {
+        uint32_t flags = irq_save();
+        runq_push(t);
+        irq_restore(flags);
+    }
+    return t;
+}
+
+void thread_yield(void) {
+    if (!current)
+        return;
+
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_sleep(uint32_t n) {
+    if (!current)
+        return;
+
+    uint32_t flags = irq_save();
+    current->state = THREAD_SLEEPING;
+    current->wake_tick = ticks + (n ? n : 1);
+    current->next = sleepers;
+    sleepers = current;
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_exit(void) {
+    irq_save();
+    current->state = THREAD_DEAD;
+    zombie = current;
+    schedule();
+    for (;;)
+        ;                               // not reached
+}
+
+struct thread *thread_current(void) {
+    return current;
+}
+
+uint32_t thread_ticks(void) {
+    return ticks;
+}
+
+void thread_wait(struct wait_queue *wq) {
+    if (!current) {
+        __asm__ __volatile__("sti\n\thlt\n\tcli" ::: "memory");
+        return;
+    }
+
+    current->state = THREAD_BLOCKED;
+    current->next = wq->head;
+    wq->head = current;
+    schedule();
+}
+
+void thread_wake_all(struct wait_queue *wq) {
+    struct thread *t = wq->head;
+
+    wq->head = NULL;
+    while (t) {
+        struct thread *next = t->next;
+        runq_push(t);
+        t = next;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include "trace.h"
+#include <stdint.h>
+
+/*
+ * Preemptive kernel threads on one CPU. thread_init() turns the boot code
+ * into the "main" thread and starts the PIT at THREAD_HZ; a thread that
+ * runs for THREAD_SLICE_TICKS ticks is moved to the back of the run queue.
+ * When nothing is runnable the idle thread halts the CPU.
+ *
+ * Each thread gets THREAD_STACK_PAGES of identity mapped frames from the
+ * page frame allocator. Threads only run on the bootstrap processor.
+ *
+ */
+
+#define THREAD_HZ           100
+#define THREAD_SLICE_TICKS  2
+#define THREAD_STACK_PAGES  4
+
+#define THREAD_RUNNING  0
+#define THREAD_RUNNABLE 1
+#define THREAD_BLOCKED  2
+#define THREAD_SLEEPING 3
+#define THREAD_DEAD     4
+
+struct ppage;
+
+struct thread {
+    uint32_t esp;                   // saved by thread_switch, keep first
+    uint32_t id;
+    const char *name;
+    int state;
+    void (*entry)(void *arg);
+    void *arg;
+    struct ppage *stack;            // NULL for the boot thread
+    uint32_t wake_tick;
+    uint32_t slice;                 // ticks left before preemption
+    uint32_t ticks;                 // ticks spent running
+    struct thread *next;            // run queue, wait queue or sleeper list
+    struct trace_context trace;     // open trace spans
+};
+
+//Threads blocked until an event, woken all at once
+struct wait_queue {
+    struct thread *head;
+};
+
+void thread_init(void);
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg);
+void thread_yield(void);
+void thread_sleep(uint32_t ticks);
+void thread_exit(void);
+struct thread *thread_current(void);
+uint32_t thread_ticks(void);
+
+//thread_wait() must be called with interrupts off and returns with them
+//off, so a condition checked before it can't be missed. Before
+//thread_init() it just halts until the next interrupt.
+void thread_wait(struct wait_queue *wq);
+void thread_wake_all(struct wait_queue *wq);
+
+#endif
@@ -0,0 +1,101 @@
+#include "trace.h"
+#include "clock.h"
+#include "interrupt.h"
+#include "rprintf.h"
+#include "thread.h"
+#include "vga.h"
+#include <stdint.h>
+
+static struct trace_span spans[TRACE_MAX_SPANS];
+static int num_spans = 0;
+
+//spans of the boot code, which the main thread carries on after thread_init
+static struct trace_context boot_context;
+
+static struct trace_context *trace_context(void) {
+    struct thread *t = thread_current();
+    return t && t->stack ? &t->trace : &boot_context;
+}
+
+//The span table is shared by all threads; interrupts are off while it
+//changes so a thread switch can't interleave two updates
+void trace_begin(const char *name) {
+    struct trace_context *ctx = trace_context();
+    if (ctx->skipped || ctx->depth >= TRACE_MAX_DEPTH) {
+        ctx->skipped++;
+        return;
+    }
+
+    int parent = ctx->depth ? ctx->span[ctx->depth - 1] : -1;
+    uint32_t flags = irq_save();
+    int i;
+    for (i = 0; i < num_spans; i++)
+        if (spans[i].parent == parent && spans[i].name == name)
+            break;
+    if (i == num_spans) {
+        if (num_spans == TRACE_MAX_SPANS) {
+            irq_restore(flags);
+            ctx->skipped++;
+            return;
+        }
+        spans[i].name = name;
+        spans[i].parent = parent;
+        spans[i].depth = ctx->depth;
+        spans[i].count = 0;
+        spans[i].total = 0;
+        num_spans++;
+    }
+    irq_restore(flags);
+
+    ctx->span[ctx->depth] = i;
+    ctx->start[ctx->depth] = rdtsc();
+    ctx->depth++;
+}
+
+void trace_end(void) {
+    uint64_t now = rdtsc();
+    struct trace_context *ctx = trace_context();
+
+    if (ctx->skipped) {
+        ctx->skipped--;
+        return;
+    }
+    if (ctx->depth == 0)
+        return;
+
+    ctx->depth--;
+    uint32_t flags = irq_save();
+    struct trace_span *s = &spans[ctx->span[ctx->depth]];
+    s->total += now - ctx->start[ctx->depth];
+    s->count++;
+    irq_restore(flags);
+}
+
+//children are printed right after their parent, in the order they first
+//ran, indented by depth
+static void dump_children(int parent) {
+    for (int i = 0; i < num_spans; i++) {
+        if (spans[i].parent != parent)
+            continue;
+
+        char label[32];
+        int n = 0;
+        while (n < 2 * spans[i].depth)
+            label[n++] = ' ';
+        esp_snprintf(label + n, sizeof(label) - n, "%s", spans[i].name);
+
+        if (spans[i].count) {
+            uint32_t us = clock_cycles_to_us(spans[i].total);
+            esp_sink_printf(vga_sink, NULL, "%-28s %6d %10d %8d\n",
+                            label, spans[i].count, us, us / spans[i].count);
+        } else {
+            esp_sink_printf(vga_sink, NULL, "%-28s   (still open)\n", label);
+        }
+        dump_children(i);
+    }
+}
+
+void trace_dump(void) {
+    esp_sink_printf(vga_sink, NULL, "%-28s %6s %10s %8s\n", "span", "calls", "total us", "avg us");
+    dump_children(-1);
+}
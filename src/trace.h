@@ -0,0 +1,52 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Trace spans. trace_begin()/trace_end() bracket a piece of work and
+ * spans begun inside another nest under it. Spans with the same name and
+ * parent are merged, so a call made in a loop (ata_read under fatInit)
+ * shows up once with its call count and total time. trace_dump() prints
+ * the tree as a table.
+ *
+ * Each thread keeps its own stack of open spans, so spans from threads
+ * that preempt each other nest under the right parent. The page fault
+ * handler runs on the faulting thread and may trace like it. Interrupt
+ * handlers and other CPUs must not trace.
+ *
+ */
+
+#define TRACE_MAX_SPANS 64
+#define TRACE_MAX_DEPTH 8
+
+struct trace_span {
+    const char *name;
+    int parent;                     // index, -1 for top level spans
+    uint8_t depth;
+    uint32_t count;
+    uint64_t total;                 // cycles over all calls
+};
+
+//Open spans of one thread. Begins past TRACE_MAX_DEPTH or a full table
+//are counted in skipped and ignored by the matching end.
+struct trace_context {
+    int depth;
+    int skipped;
+    int span[TRACE_MAX_DEPTH];
+    uint64_t start[TRACE_MAX_DEPTH];    // TSC at each open trace_begin()
+};
+
+void trace_begin(const char *name);
+void trace_end(void);
+void trace_dump(void);
+
+#ifdef CONFIG_TRACE
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END()       trace_end()
+#else
+#define TRACE_BEGIN(name) do { } while (0)
+#define TRACE_END()       do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+#include "vga.h"
+#include "interrupt.h"
+#include "io.h"
+#include "klib.h"
+#include "rprintf.h"
+#include <stdint.h>
+
+#define VGA_TEXT_BASE 0xB8000
+#define VRAM_ROWS     204           // 32 KiB of text memory in 80 column rows
+
+#define BLANK_CELL    0x0720        // ' ', light grey on black
+#define BLANK_CELLS   0x07200720
+#define ALL_ROWS      ((1u << SCREEN_HEIGHT) - 1)
+
+#define CRTC_INDEX        0x3D4
+#define CRTC_DATA         0x3D5
+#define CRTC_CURSOR_START 0x0A
+#define CRTC_CURSOR_END   0x0B
+#define CRTC_START_HI     0x0C
+#define CRTC_CURSOR_HI    0x0E
+
+//Screen contents in RAM. Screen row r is shadow row (top + r) % SCREEN_HEIGHT,
+//so scrolling only moves top and clears the row that comes into view.
+static uint16_t shadow[SCREEN_HEIGHT][SCREEN_WIDTH];
+static int top = 0;
+
+//Screen rows that differ from video memory, one bit per row
+static uint32_t dirty = 0;
+
+//Video memory row at the top of the screen. Each scroll moves it down a
+//row; when the screen would run off the end of text memory it goes back
+//to row 0 and the whole screen is redrawn.
+static int origin = 0;
+static int shown_origin = -1;       // value last written to the CRTC
+
+static int x = 0;
+static int y = 0;
+static int ready = 0;
+
+//CRTC registers holding 16 bit values are a high/low pair
+static void crtc_write16(uint8_t reg, uint16_t value) {
+    outb(CRTC_INDEX, reg);
+    outb(CRTC_DATA, value >> 8);
+    outb(CRTC_INDEX, reg + 1);
+    outb(CRTC_DATA, value & 0xFF);
+}
+
+static void vga_init(void) {
+    memset32(shadow, BLANK_CELLS, SCREEN_HEIGHT * SCREEN_WIDTH / 2);
+    top = 0;
+    origin = 0;
+    dirty = ALL_ROWS;
+
+    //underline cursor on scanlines 14-15
+    outb(CRTC_INDEX, CRTC_CURSOR_START);
+    outb(CRTC_DATA, (inb(CRTC_DATA) & 0xC0) | 14);
+    outb(CRTC_INDEX, CRTC_CURSOR_END);
+    outb(CRTC_DATA, (inb(CRTC_DATA) & 0xE0) | 15);
+    ready = 1;
+}
+
+static void scroll_up(void) {
+    //the old top row comes back in at the bottom
+    memset32(shadow[top], BLANK_CELLS, SCREEN_WIDTH / 2);
+    top = (top + 1) % SCREEN_HEIGHT;
+
+    dirty >>= 1;
+    if (++origin + SCREEN_HEIGHT > VRAM_ROWS) {
+        origin = 0;
+        dirty = ALL_ROWS;
+    } else {
+        dirty |= 1u << (SCREEN_HEIGHT - 1);
+    }
+}
+
+void vga_flush(void) {
+    volatile uint32_t *vram = (volatile uint32_t *)VGA_TEXT_BASE;
+    uint32_t flags = irq_save();
+
+    if (!ready)
+        vga_init();
+
+    for (int r = 0; dirty; r++) {
+        if (!(dirty & (1u << r)))
+            continue;
+        const uint32_t *src = (const uint32_t *)shadow[(top + r) % SCREEN_HEIGHT];
+        volatile uint32_t *dst = vram + (origin + r) * (SCREEN_WIDTH / 2);
+        for (int i = 0; i < SCREEN_WIDTH / 2; i++)
+            dst[i] = src[i];
+        dirty &= ~(1u << r);
+    }
+
+    if (origin != shown_origin) {
+        crtc_write16(CRTC_START_HI, origin * SCREEN_WIDTH);
+        shown_origin = origin;
+    }
+    crtc_write16(CRTC_CURSOR_HI, (origin + y) * SCREEN_WIDTH + x);
+    irq_restore(flags);
+}
+
+//Put one character in the shadow buffer; returns 1 at the end of a line
+static int vga_emit(int c) {
+    if (c == '\n'){
+        x = 0;
+        y++;
+    } else if (c == '\r'){
+        x = 0;
+    } else if (c == '\b'){
+        //erase back to the start of the line, not across it
+        if (x > 0) {
+            x--;
+            shadow[(top + y) % SCREEN_HEIGHT][x] = BLANK_CELL;
+            dirty |= 1u << y;
+        }
+    } else{
+        shadow[(top + y) % SCREEN_HEIGHT][x] = (BLANK_CELL & 0xFF00) | (uint8_t)c;
+        dirty |= 1u << y;
+        x++;
+    }
+    if (x >= SCREEN_WIDTH) {
+        x = 0;
+        y++;
+    }
+    if (y >= SCREEN_HEIGHT) {
+        scroll_up();
+        y = SCREEN_HEIGHT - 1;
+    }
+    return c == '\n';
+}
+
+//Interrupts are held off while the shadow buffer changes so a thread
+//switch can't interleave two writers inside a line update
+int putc(int c){
+    uint32_t flags = irq_save();
+
+    if (!ready)
+        vga_init();
+
+    if (vga_emit(c))
+        vga_flush();
+    irq_restore(flags);
+    return c;
+}
+
+//A run of characters costs a single flush at the end
+void vga_write(const char *buf, uint32_t len) {
+    uint32_t flags = irq_save();
+
+    if (!ready)
+        vga_init();
+
+    for (uint32_t i = 0; i < len; i++)
+        vga_emit(buf[i]);
+    vga_flush();
+    irq_restore(flags);
+}
+
+void vga_sink(void *ctx, const char *chunk, size_t n) {
+    vga_write(chunk, n);
+}
+
+int vga_putc(int c) { return putc(c); }
+
+#ifdef CONFIG_BENCHMARKS
+
+//The console as it was: cells stored straight into video memory and every
+//scroll copying the screen up inside video memory
+static int legacy_x, legacy_y;
+
+static int legacy_putc(int c) {
+    uint16_t *vram = (uint16_t *)VGA_TEXT_BASE;
+
+    if (c == '\n') {
+        legacy_x = 0;
+        legacy_y++;
+    } else if (c == '\r') {
+        legacy_x = 0;
+    } else {
+        vram[legacy_y * SCREEN_WIDTH + legacy_x] = (BLANK_CELL & 0xFF00) | (uint8_t)c;
+        legacy_x++;
+    }
+    if (legacy_x >= SCREEN_WIDTH) {
+        legacy_x = 0;
+        legacy_y++;
+    }
+    if (legacy_y >= SCREEN_HEIGHT) {
+        memmove(vram, vram + SCREEN_WIDTH, (SCREEN_HEIGHT - 1) * SCREEN_WIDTH * 2);
+        memset32(vram + (SCREEN_HEIGHT - 1) * SCREEN_WIDTH, BLANK_CELLS, SCREEN_WIDTH / 2);
+        legacy_y = SCREEN_HEIGHT - 1;
+    }
+    return c;
+}
+
+static uint32_t print_banner(func_ptr out) {
+    uint64_t t0 = rdtsc();
+    for (int i = 1; i <= 30; i++)
+        esp_printf(out, "Line %d: Sphinx of black quartz, judge my vow.\r\n", i);
+    if (out == putc)
+        vga_flush();
+    return (uint32_t)(rdtsc() - t0) / 1000;
+}
+
+//Kilocycles to print main's 30 line banner with the screen already full,
+//so every line scrolls
+void vga_benchmark(void) {
+    //the old console assumes video memory row 0 is at the top
+    origin = 0;
+    dirty = ALL_ROWS;
+    vga_flush();
+    legacy_x = 0;
+    legacy_y = SCREEN_HEIGHT - 1;
+    uint32_t direct = print_banner(legacy_putc);
+
+    //put back what the shadow says is on screen
+    dirty = ALL_ROWS;
+    vga_flush();
+    uint32_t shadowed = print_banner(putc);
+
+    esp_sink_printf(vga_sink, NULL, "VGA 30 line banner: %d kcycles direct, %d kcycles shadowed\n",
+                    direct, shadowed);
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __VGA_H__
+#define __VGA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * VGA text console. Output goes to a shadow copy of the screen in RAM and
+ * only rows that changed are copied to video memory, a dword at a time,
+ * when a line is finished or on vga_flush(). Scrolling moves the CRTC
+ * start address instead of copying the screen.
+ *
+ */
+
+#define SCREEN_WIDTH 80
+#define SCREEN_HEIGHT 25
+
+int putc(int c);
+
+//adapter for esp_printf
+int vga_putc(int c);
+
+//Show output that isn't followed by a newline yet
+void vga_flush(void);
+
+//Write a run of characters; vga_sink is the same for esp_sink_printf
+void vga_write(const char *buf, uint32_t len);
+void vga_sink(void *ctx, const char *chunk, size_t n);
+
+void vga_benchmark(void);
+
+#endif